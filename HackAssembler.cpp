@@ -5,7 +5,7 @@ This is an awesome assembler for the Nand to Tetris course
 author: wang yue
 email: wy_workplace@163.com
 date: 2024-09-30
-version: 1.0
+version: 1.1
 This is a C++ implementation of the Hack Assembler. It reads a file containing
 assembly code and generates a binary file that can be loaded into the Hack
 computer. The assembler supports the following instructions:
@@ -30,32 +30,157 @@ The assembler also uses a symbol table to store the addresses of symbols. The
 symbol table is implemented as an unordered_map, which allows for constant time
 access to the address of a symbol.
 
+To build it (C++17, threads for the daemon):
+
+g++ -std=c++17 -O2 -pthread HackAssembler.cpp -o HackAssembler
+
 To use the assembler, you can run the following command:
 
 ./HackAssembler input.asm input.hack
 
 This will assemble the input.asm file and generate a binary file named
 "input.hack".
+
+Options:
+
+--bench [NAME...] time the assembler on generated worst-case inputs and check
+                  the results, failing if any is wrong or over its time limit
+--batch N         resolve N symbol references per prefetch batch (default 32)
+--cache DIR       reuse the output of an identical earlier run from DIR
+--cache-size MB   evict least recently used cache entries above MB (default 256)
+--cache-stats     print cache hits, misses and size (alone: just print them)
+--daemon SOCKET   serve assemble requests on a Unix socket (--threads N workers,
+                  --cache-size MB of results kept in memory)
+--connect SOCKET  send the file to a daemon instead, falling back to assembling
+                  in-process if none is listening or it stops answering (or
+                  set HACK_ASSEMBLER_SOCKET)
+--watch           keep running and reassemble the changed lines on every save
+                  (Linux only, elsewhere it exits with an error)
+--object          write a relocatable object (.hobj) instead of a .hack file
+--emit-c          write the program as a C function, hack_run(), that runs it
+                  like the emulator does (build with -DHACK_MAIN for a main)
+--link            link the given objects, in order, into the last file named
+                  (--threads N workers)
+--manifest FILE   assemble each input.asm to input.hack, skipping targets that
+                  FILE records as up to date (--threads N workers)
+--run             run the program (.asm, or .hack as is) on the built-in
+                  emulator until it halts or --cycles N (default 10^9) have
+                  run; --set ADDR=VALUE first, --print ADDR[-ADDR] after
+--jit             with --run, translate the program to x86-64 as it runs
+--analyze         print each routine's size, loops and the cycles of its
+                  shortest and longest acyclic paths, without running it
+--debug FILE      write each word's source line and the label and variable
+                  addresses to FILE; with --run or --analyze of a .hack
+                  file, read them from FILE instead
+--trace FILE      with --run, keep the last steps (pc, A, D and the RAM word
+                  written) in a --trace-size KB ring (default 1024) and
+                  write them to FILE when the run ends, stops at a --break
+                  ADDR|LABEL, or gets SIGINT or SIGTERM; SIGUSR1 writes
+                  them without stopping
+--save-state FILE with --run, write the machine (RAM, A, D, PC and cycles) to
+                  FILE when the run ends
+--load-state FILE with --run or --test, start from the machine in FILE, after
+                  loading the program it was saved with
+--profile FILE    with --run, write the cycles spent under each label to FILE
+--stacks FILE     with --run, write the cycles as collapsed stacks
+                  (routine;label;file:line count) for flame graph tools
+--test            run Nand2Tetris CPU emulator scripts (.tst) on the built-in
+                  emulator, comparing their output with the .cmp files
+                  (--threads N scripts at a time); a repeat without a count
+                  runs until the program halts or --cycles N have run
+--grade DIR       run the scripts on every .asm under DIR in place of the
+                  program they load; identical sources are graded once.
+                  Writes --report FILE (grades.json, or CSV for .csv) with
+                  limits of --cycles N per test, --time-limit SECONDS of CPU
+                  (default 10) and --size-limit KB of source (default 1024)
 The assembler can also be used as a standalone program by running the
 "assembler.exe" file.
 The source code is available on GitHub: https://github.com/wynagito/HackAssembler 
 
 */
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cerrno>
+#include <condition_variable>
+#include <csignal>
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <filesystem>
 #include <fstream>
+#include <functional>
 #include <iostream>
+#include <list>
+#include <map>
+#include <mutex>
+#include <random>
+#include <sstream>
 #include <string>
+#include <string_view>
+#include <thread>
 #include <unordered_map>
+#include <vector>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <linux/perf_event.h>
+#include <poll.h>
+#include <sys/file.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#define HAVE_UNIX_SOCKETS 1
+#endif
+
+// the classifiers and their runtime cpu dispatch (__builtin_cpu_supports)
+// need GCC or Clang; other compilers use the scalar classifier
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
+
+#if defined(__GNUC__) && defined(__x86_64__) && defined(__linux__)
+#define HAVE_X86_64_JIT 1
+#endif
+
+// for small hooks the interpreter calls every instruction, which the
+// compiler would otherwise leave as calls from its one shared dispatch
+#if defined(__GNUC__)
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+#else
+#define ALWAYS_INLINE inline
+#endif
 
 using namespace std;
 
+#define ASSEMBLER_VERSION "1.1"
+
 #define A_INSTRUCTION 1
 #define C_INSTRUCTION 2
 #define L_INSTRUCTION 3
 
 void trim(string &s);
-bool AllisNum(string s);
-int stonum(string str);
+int runBenchmarks(int argc, char *argv[]);
 
 class Code
 {
@@ -74,6 +199,14 @@ public:
         destMap["AM"] = "101";
         destMap["AD"] = "110";
         destMap["ADM"] = "111";
+        // the book spells it AMD, any order of the registers is accepted
+        destMap["MA"] = "101";
+        destMap["DA"] = "110";
+        destMap["AMD"] = "111";
+        destMap["MAD"] = "111";
+        destMap["MDA"] = "111";
+        destMap["DAM"] = "111";
+        destMap["DMA"] = "111";
         compMap["0"] = "101010";
         compMap["1"] = "111111";
         compMap["-1"] = "111010";
@@ -111,207 +244,882 @@ public:
         jumpMap["JLE"] = "110";
         jumpMap["JMP"] = "111";
     }
-    string dest(string d)
+    // the lookups are const so one Code can be shared between threads
+    string dest(string d) const
+    {
+        return destMap.at(d);
+    }
+    string comp(string c) const
+    {
+        return c.find('M') == string::npos ? "0" + compMap.at(c) : "1" + compMap.at(c);
+    }
+    string jump(string j) const
+    {
+        return jumpMap.at(j);
+    }
+    // returns the 16-bit word of a C instruction
+    uint16_t word(string d, string c, string j) const
     {
-        return destMap[d];
+        return (uint16_t)stoi("111" + comp(c) + dest(d) + jump(j), nullptr, 2);
     }
-    string comp(string c)
+    // returns an error message if a field is not a known mnemonic
+    string check(string d, string c, string j) const
     {
-        return c.find('M') == -1 ? "0" + compMap[c] : "1" + compMap[c];
+        if (destMap.find(d) == destMap.end())
+            return "unknown dest '" + d + "'";
+        if (compMap.find(c) == compMap.end())
+            return "unknown comp '" + c + "'";
+        if (jumpMap.find(j) == jumpMap.end())
+            return "unknown jump '" + j + "'";
+        return "";
     }
-    string jump(string j)
+};
+
+// the predefined symbols of the Hack platform
+struct PredefinedSymbol
+{
+    string_view name;
+    int address;
+};
+
+static constexpr PredefinedSymbol predefinedSymbols[] = {
+    {"SP", 0}, {"LCL", 1}, {"ARG", 2}, {"THIS", 3}, {"THAT", 4}, {"SCREEN", 16384}, {"KBD", 24576}};
+
+// returns the address of a predefined symbol or -1
+// R0..R15 are decoded rather than looked up
+constexpr int predefinedAddress(string_view s)
+{
+    if (s.size() >= 2 && s.size() <= 3 && s[0] == 'R' && s[1] >= '0' && s[1] <= '9')
+    {
+        if (s.size() == 2)
+            return s[1] - '0';
+        if (s[1] == '1' && s[2] >= '0' && s[2] <= '5')
+            return 10 + s[2] - '0';
+        return -1;
+    }
+    for (const PredefinedSymbol &p : predefinedSymbols)
+    {
+        if (p.name == s)
+            return p.address;
+    }
+    return -1;
+}
+
+static_assert(predefinedAddress("R13") == 13 && predefinedAddress("KBD") == 24576 && predefinedAddress("R16") == -1,
+              "predefined symbol tier");
+
+// 64-bit FNV-1a hash of a symbol name
+static inline uint64_t hashSymbol(const char *s, size_t n)
+{
+    uint64_t h = 14695981039346656037ull;
+    for (size_t i = 0; i < n; i++)
     {
-        return jumpMap[j];
+        h ^= (unsigned char)s[i];
+        h *= 1099511628211ull;
     }
+    return h;
+}
+
+// rehash a symbol hash with a seed (murmur3 finalizer)
+static inline uint64_t mixHash(uint64_t h, uint64_t seed)
+{
+    h ^= seed * 0x9E3779B97F4A7C15ull;
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDull;
+    h ^= h >> 33;
+    h *= 0xC4CEB9FE1A85EC53ull;
+    h ^= h >> 33;
+    return h;
+}
+
+// marks a bucket holding a single key that was placed in a slot directly
+#define DIRECT_SLOT 0x80000000u
+
+// seeds tried for one bucket before freeze() gives up on the perfect hash
+#define MAX_SEED (1u << 20)
+
+#if defined(__GNUC__)
+#define PREFETCH(p) __builtin_prefetch(p)
+#else
+#define PREFETCH(p) ((void)0)
+#endif
+
+// an A instruction waiting for the address of its symbol
+struct SymbolRef
+{
+    uint64_t hash;
+    uint32_t index; // position of the instruction in the rom
 };
 
 class SymbolTable
 {
 public:
+    // the predefined symbols live in a constant tier checked first,
+    // symbolMap only holds the program's labels and variables
     unordered_map<string, int> symbolMap;
+
+    // after freeze() the symbols live in a minimal perfect hash: every
+    // bucket has a seed (or a direct slot) that sends its keys to distinct
+    // slots of a flat array with exactly one slot per symbol. A slot keeps
+    // the full 64-bit hash of its key instead of the name, so a lookup
+    // touches only the displacement and the slot.
+    struct Slot
+    {
+        uint64_t hash;
+        int address;
+    };
+    bool frozen;
+    vector<uint32_t> displacement;
+    vector<Slot> slots;
+
     SymbolTable()
     {
-        symbolMap["SP"] = 0;
-        symbolMap["LCL"] = 1;
-        symbolMap["ARG"] = 2;
-        symbolMap["THIS"] = 3;
-        symbolMap["THAT"] = 4;
-        symbolMap["R0"] = 0;
-        symbolMap["R1"] = 1;
-        symbolMap["R2"] = 2;
-        symbolMap["R3"] = 3;
-        symbolMap["R4"] = 4;
-        symbolMap["R5"] = 5;
-        symbolMap["R6"] = 6;
-        symbolMap["R7"] = 7;
-        symbolMap["R8"] = 8;
-        symbolMap["R9"] = 9;
-        symbolMap["R10"] = 10;
-        symbolMap["R11"] = 11;
-        symbolMap["R12"] = 12;
-        symbolMap["R13"] = 13;
-        symbolMap["R14"] = 14;
-        symbolMap["R15"] = 15;
-        symbolMap["SCREEN"] = 16384;
-        symbolMap["KBD"] = 24576;
+        frozen = false;
     }
 
     bool contains(string s)
     {
-        return symbolMap.find(s) != symbolMap.end();
+        return predefinedAddress(s) >= 0 || symbolMap.find(s) != symbolMap.end();
     }
-    int getAddress(string s)
+    int getAddress(const string &s)
     {
+        int predefined = predefinedAddress(s);
+        if (predefined >= 0)
+            return predefined;
+        if (frozen)
+        {
+            if (slots.empty())
+                return 0;
+            uint64_t h = hashSymbol(s.data(), s.size());
+            const Slot &slot = slots[findSlot(h)];
+            return slot.hash == h ? slot.address : 0;
+        }
         return symbolMap[s];
     }
     void addEntry(string s, int a)
     {
         symbolMap[s] = a;
     }
+
+    // builds the minimal perfect hash over the current symbols, expected
+    // linear time; no entries may be added afterwards. Every name looked
+    // up later is in the table, so distinct hashes make the slots exact;
+    // if two names share a hash (or no seed is found) the table stays in
+    // symbolMap and false is returned.
+    bool freeze()
+    {
+        size_t n = symbolMap.size();
+        size_t buckets = n / 2 + 1;
+        vector<uint64_t> hashes;
+        vector<int> addresses;
+        hashes.reserve(n);
+        addresses.reserve(n);
+        for (auto &entry : symbolMap)
+        {
+            hashes.push_back(hashSymbol(entry.first.data(), entry.first.size()));
+            addresses.push_back(entry.second);
+        }
+
+        // counting sort the keys by bucket
+        vector<uint32_t> start(buckets + 1, 0);
+        for (size_t i = 0; i < n; i++)
+            start[hashes[i] % buckets + 1]++;
+        uint32_t maxSize = 0;
+        for (size_t b = 0; b < buckets; b++)
+        {
+            maxSize = max(maxSize, start[b + 1]);
+            start[b + 1] += start[b];
+        }
+        vector<uint32_t> members(n);
+        vector<uint32_t> fill(start.begin(), start.end() - 1);
+        for (size_t i = 0; i < n; i++)
+            members[fill[hashes[i] % buckets]++] = (uint32_t)i;
+
+        // counting sort the buckets by size, largest first
+        vector<uint32_t> bySize(maxSize + 2, 0);
+        for (size_t b = 0; b < buckets; b++)
+            bySize[maxSize - (start[b + 1] - start[b]) + 1]++;
+        for (size_t k = 0; k <= maxSize; k++)
+            bySize[k + 1] += bySize[k];
+        vector<uint32_t> order(buckets);
+        for (size_t b = 0; b < buckets; b++)
+            order[bySize[maxSize - (start[b + 1] - start[b])]++] = (uint32_t)b;
+
+        displacement.assign(buckets, 0);
+        slots.assign(n, Slot());
+        vector<char> used(n, 0);
+        vector<size_t> placed;
+        size_t nextFree = 0;
+        for (uint32_t b : order)
+        {
+            uint32_t size = start[b + 1] - start[b];
+            if (size == 0)
+                break;
+            if (size == 1)
+            {
+                // the remaining buckets are singletons, give each one the next free slot
+                while (used[nextFree])
+                    nextFree++;
+                uint32_t i = members[start[b]];
+                displacement[b] = DIRECT_SLOT | (uint32_t)nextFree;
+                slots[nextFree].hash = hashes[i];
+                slots[nextFree].address = addresses[i];
+                used[nextFree] = 1;
+                continue;
+            }
+            // names with the same hash land in the same slot under every seed
+            for (uint32_t k = start[b]; k < start[b + 1]; k++)
+            {
+                for (uint32_t j = start[b]; j < k; j++)
+                {
+                    if (hashes[members[j]] == hashes[members[k]])
+                        return abandon();
+                }
+            }
+            // try seeds until every key of the bucket lands in a distinct free slot
+            for (uint32_t seed = 0;; seed++)
+            {
+                if (seed == MAX_SEED)
+                    return abandon();
+                placed.clear();
+                bool ok = true;
+                for (uint32_t k = start[b]; k < start[b + 1] && ok; k++)
+                {
+                    size_t slot = mixHash(hashes[members[k]], seed) % n;
+                    ok = !used[slot] && find(placed.begin(), placed.end(), slot) == placed.end();
+                    placed.push_back(slot);
+                }
+                if (!ok)
+                    continue;
+                displacement[b] = seed;
+                for (uint32_t k = 0; k < size; k++)
+                {
+                    uint32_t i = members[start[b] + k];
+                    slots[placed[k]].hash = hashes[i];
+                    slots[placed[k]].address = addresses[i];
+                    used[placed[k]] = 1;
+                }
+                break;
+            }
+        }
+        frozen = true;
+        return true;
+    }
+
+    // writes the address of every reference into the rom. The frozen table
+    // is walked in blocks of batch references: prefetch the displacements
+    // of the block, then compute and prefetch the slots, then read them,
+    // so the cache misses of a block overlap instead of stalling in turn.
+    void resolve(const vector<SymbolRef> &refs, vector<uint16_t> &rom, size_t batch)
+    {
+        if (slots.empty())
+            return;
+        vector<size_t> slotOf(batch);
+        for (size_t base = 0; base < refs.size(); base += batch)
+        {
+            size_t end = min(refs.size(), base + batch);
+            for (size_t i = base; i < end; i++)
+                PREFETCH(&displacement[refs[i].hash % displacement.size()]);
+            for (size_t i = base; i < end; i++)
+            {
+                slotOf[i - base] = findSlot(refs[i].hash);
+                PREFETCH(&slots[slotOf[i - base]]);
+            }
+            for (size_t i = base; i < end; i++)
+            {
+                const Slot &slot = slots[slotOf[i - base]];
+                // an A instruction carries 15 bits of address
+                rom[refs[i].index] = slot.hash == refs[i].hash ? (uint16_t)(slot.address & 0x7FFF) : 0;
+            }
+        }
+    }
+
+private:
+    bool abandon()
+    {
+        displacement.clear();
+        slots.clear();
+        return false;
+    }
+
+    size_t findSlot(uint64_t h)
+    {
+        uint32_t d = displacement[h % displacement.size()];
+        if (d & DIRECT_SLOT)
+            return d & ~DIRECT_SLOT;
+        return mixHash(h, d) % slots.size();
+    }
 };
 
-class Parser
+// index of the lowest and highest set bit, and the number of set bits;
+// x must not be zero for the first two
+#if defined(__GNUC__)
+#define LOWEST_BIT(x) __builtin_ctzll(x)
+#define HIGHEST_BIT(x) (63 - __builtin_clzll(x))
+#define BIT_COUNT(x) __builtin_popcountll(x)
+#else
+#if defined(_MSC_VER) && defined(_M_X64)
+#include <intrin.h>
+#pragma intrinsic(_BitScanForward64, _BitScanReverse64)
+#endif
+static inline int lowestBit(uint64_t x)
+{
+#if defined(_MSC_VER) && defined(_M_X64)
+    unsigned long i;
+    _BitScanForward64(&i, x);
+    return (int)i;
+#else
+    int i = 0;
+    while (!(x & 1))
+    {
+        x >>= 1;
+        i++;
+    }
+    return i;
+#endif
+}
+static inline int highestBit(uint64_t x)
+{
+#if defined(_MSC_VER) && defined(_M_X64)
+    unsigned long i;
+    _BitScanReverse64(&i, x);
+    return (int)i;
+#else
+    int i = 63;
+    while (!(x >> 63))
+    {
+        x <<= 1;
+        i--;
+    }
+    return i;
+#endif
+}
+static inline int bitCount(uint64_t x)
+{
+    x = x - ((x >> 1) & 0x5555555555555555ull);
+    x = (x & 0x3333333333333333ull) + ((x >> 2) & 0x3333333333333333ull);
+    x = (x + (x >> 4)) & 0x0F0F0F0F0F0F0F0Full;
+    return (int)((x * 0x0101010101010101ull) >> 56);
+}
+#define LOWEST_BIT(x) lowestBit(x)
+#define HIGHEST_BIT(x) highestBit(x)
+#define BIT_COUNT(x) bitCount(x)
+#endif
+
+// bit masks describing one 64 byte block of the source, bit i is byte i
+struct BlockMasks
+{
+    uint64_t newline;
+    uint64_t space; // ' ' '\t' '\r' '\v' '\f'
+    uint64_t slash;
+};
+
+// one non-empty source line after whitespace and comments are removed
+// begin/end are offsets into the source buffer
+struct LineSpan
+{
+    size_t begin;
+    size_t end;
+    uint32_t number; // 1-based source line number
+    bool compact;    // no whitespace between begin and end
+};
+
+static void classifyScalar(const char *p, BlockMasks &m)
+{
+    m = BlockMasks();
+    for (int i = 0; i < 64; i++)
+    {
+        uint64_t bit = (uint64_t)1 << i;
+        switch (p[i])
+        {
+        case '\n':
+            m.newline |= bit;
+            break;
+        case ' ':
+        case '\t':
+        case '\r':
+        case '\v':
+        case '\f':
+            m.space |= bit;
+            break;
+        case '/':
+            m.slash |= bit;
+            break;
+        }
+    }
+}
+
+#ifdef HAVE_X86_SIMD
+static inline uint64_t eqMask16(__m128i v, char c)
+{
+    return (uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8(c)));
+}
+
+static void classifySSE2(const char *p, BlockMasks &m)
+{
+    m = BlockMasks();
+    for (int i = 0; i < 4; i++)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + 16 * i));
+        // '\t' '\n' '\v' '\f' '\r' are 9..13, take them as one range
+        __m128i ctl = _mm_cmpeq_epi8(_mm_subs_epu8(_mm_sub_epi8(v, _mm_set1_epi8(9)), _mm_set1_epi8(4)), _mm_setzero_si128());
+        uint64_t nl = eqMask16(v, '\n');
+        uint64_t sp = ((uint16_t)_mm_movemask_epi8(ctl) | eqMask16(v, ' ')) & ~nl;
+        int shift = 16 * i;
+        m.newline |= nl << shift;
+        m.space |= sp << shift;
+        m.slash |= eqMask16(v, '/') << shift;
+    }
+}
+
+__attribute__((target("avx2"))) static inline uint64_t eqMask32(__m256i v, char c)
+{
+    return (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(c)));
+}
+
+__attribute__((target("avx2"))) static void classifyAVX2(const char *p, BlockMasks &m)
+{
+    m = BlockMasks();
+    for (int i = 0; i < 2; i++)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(p + 32 * i));
+        __m256i ctl = _mm256_cmpeq_epi8(_mm256_subs_epu8(_mm256_sub_epi8(v, _mm256_set1_epi8(9)), _mm256_set1_epi8(4)), _mm256_setzero_si256());
+        uint64_t nl = eqMask32(v, '\n');
+        uint64_t sp = ((uint32_t)_mm256_movemask_epi8(ctl) | eqMask32(v, ' ')) & ~nl;
+        int shift = 32 * i;
+        m.newline |= nl << shift;
+        m.space |= sp << shift;
+        m.slash |= eqMask32(v, '/') << shift;
+    }
+}
+#endif
+
+// splits a source buffer into lines 64 bytes at a time, stripping
+// whitespace and comments on the way; the structural characters
+// '@' '(' ')' '=' ';' are left to the DFA, which reads each line once anyway
+class Scanner
 {
 public:
-    ifstream inputFile;
-    string line;
+    typedef void (*Classifier)(const char *, BlockMasks &);
+    Classifier classify;
+
+    Scanner()
+    {
+        classify = classifyScalar;
+#ifdef HAVE_X86_SIMD
+        // pick the widest classifier the cpu supports at runtime
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))
+            classify = classifyAVX2;
+        else if (__builtin_cpu_supports("sse2"))
+            classify = classifySSE2;
+#endif
+    }
+
+    void scan(const char *buf, size_t n, vector<LineSpan> &lines)
+    {
+        char tail[64];
+        uint32_t number = 1;
+        size_t first = string::npos, last = 0, count = 0;
+        bool inComment = false;
+        for (size_t base = 0; base < n; base += 64)
+        {
+            const char *p = buf + base;
+            uint64_t valid = ~(uint64_t)0;
+            if (n - base < 64)
+            {
+                // pad the last block with spaces
+                memset(tail, ' ', 64);
+                memcpy(tail, p, n - base);
+                p = tail;
+                valid = ((uint64_t)1 << (n - base)) - 1;
+            }
+            BlockMasks m;
+            classify(p, m);
+            // a comment starts at every '/' followed by another '/'
+            uint64_t nextSlash = base + 64 < n && buf[base + 64] == '/';
+            uint64_t comment = m.slash & ((m.slash >> 1) | (nextSlash << 63));
+            uint64_t sig = ~(m.space | m.newline);
+
+            uint64_t rest = valid;
+            while (rest)
+            {
+                uint64_t nl = m.newline & rest;
+                uint64_t nlBit = nl & (0 - nl);
+                uint64_t seg = nl ? rest & (nlBit - 1) : rest;
+                if (!inComment)
+                {
+                    uint64_t c = comment & seg;
+                    uint64_t live = seg;
+                    if (c)
+                    {
+                        live &= (c & (0 - c)) - 1;
+                        inComment = true;
+                    }
+                    uint64_t x = sig & live;
+                    if (x)
+                    {
+                        if (first == string::npos)
+                            first = base + LOWEST_BIT(x);
+                        last = base + HIGHEST_BIT(x);
+                        count += BIT_COUNT(x);
+                    }
+                }
+                if (!nl)
+                    break;
+                push(lines, number, first, last, count);
+                number++;
+                first = string::npos;
+                count = 0;
+                inComment = false;
+                rest &= ~(nlBit | (nlBit - 1));
+            }
+        }
+        push(lines, number, first, last, count);
+    }
+
+private:
+    static void push(vector<LineSpan> &lines, uint32_t number, size_t first, size_t last, size_t count)
+    {
+        if (first == string::npos)
+            return; // blank or comment-only line
+        LineSpan l;
+        l.begin = first;
+        l.end = last + 1;
+        l.number = number;
+        l.compact = count == l.end - l.begin;
+        lines.push_back(l);
+    }
+};
+
+// character classes seen by the instruction DFA
+enum CharClass
+{
+    CC_OTHER,
+    CC_DIGIT,
+    CC_SYMBOL, // letters and _ . $ :
+    CC_OP,     // + - ! & |
+    CC_AT,
+    CC_LPAREN,
+    CC_RPAREN,
+    CC_EQ,
+    CC_SEMI,
+    CC_COUNT
+};
+
+// states of the instruction DFA
+enum DfaState
+{
+    S_START,
+    S_A_BEGIN,    // @
+    S_A_NUMBER,   // @123
+    S_A_SYMBOL,   // @name
+    S_L_BEGIN,    // (
+    S_L_SYMBOL,   // (name
+    S_L_END,      // (name)
+    S_C_FIRST,    // dest or comp
+    S_COMP_BEGIN, // dest=
+    S_COMP,       // dest=comp
+    S_JUMP_BEGIN, // comp;
+    S_JUMP,       // comp;jump
+    S_ERROR,
+    S_COUNT
+};
+
+typedef array<uint8_t, 256> CharClassTable;
+typedef array<array<uint8_t, CC_COUNT>, S_COUNT> DfaTable;
 
-    Parser(string inputFileName)
+constexpr CharClassTable makeCharClasses()
+{
+    CharClassTable t{};
+    for (int c = 0; c < 256; c++)
     {
-        inputFile.open(inputFileName);
+        if (c >= '0' && c <= '9')
+            t[c] = CC_DIGIT;
+        else if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_' || c == '.' || c == '$' || c == ':')
+            t[c] = CC_SYMBOL;
+        else if (c == '+' || c == '-' || c == '!' || c == '&' || c == '|')
+            t[c] = CC_OP;
+        else if (c == '@')
+            t[c] = CC_AT;
+        else if (c == '(')
+            t[c] = CC_LPAREN;
+        else if (c == ')')
+            t[c] = CC_RPAREN;
+        else if (c == '=')
+            t[c] = CC_EQ;
+        else if (c == ';')
+            t[c] = CC_SEMI;
+        else
+            t[c] = CC_OTHER;
     }
-    ~Parser()
+    return t;
+}
+
+constexpr DfaTable makeDfa()
+{
+    DfaTable t{};
+    for (int s = 0; s < S_COUNT; s++)
+        for (int c = 0; c < CC_COUNT; c++)
+            t[s][c] = S_ERROR;
+    t[S_START][CC_AT] = S_A_BEGIN;
+    t[S_START][CC_LPAREN] = S_L_BEGIN;
+    t[S_START][CC_DIGIT] = t[S_START][CC_SYMBOL] = t[S_START][CC_OP] = S_C_FIRST;
+    // a symbol may not start with a digit, a number must be all digits
+    t[S_A_BEGIN][CC_DIGIT] = S_A_NUMBER;
+    t[S_A_BEGIN][CC_SYMBOL] = S_A_SYMBOL;
+    t[S_A_NUMBER][CC_DIGIT] = S_A_NUMBER;
+    t[S_A_SYMBOL][CC_DIGIT] = t[S_A_SYMBOL][CC_SYMBOL] = S_A_SYMBOL;
+    t[S_L_BEGIN][CC_SYMBOL] = S_L_SYMBOL;
+    t[S_L_SYMBOL][CC_DIGIT] = t[S_L_SYMBOL][CC_SYMBOL] = S_L_SYMBOL;
+    t[S_L_SYMBOL][CC_RPAREN] = S_L_END;
+    t[S_C_FIRST][CC_DIGIT] = t[S_C_FIRST][CC_SYMBOL] = t[S_C_FIRST][CC_OP] = S_C_FIRST;
+    t[S_C_FIRST][CC_EQ] = S_COMP_BEGIN;
+    t[S_C_FIRST][CC_SEMI] = S_JUMP_BEGIN;
+    t[S_COMP_BEGIN][CC_DIGIT] = t[S_COMP_BEGIN][CC_SYMBOL] = t[S_COMP_BEGIN][CC_OP] = S_COMP;
+    t[S_COMP][CC_DIGIT] = t[S_COMP][CC_SYMBOL] = t[S_COMP][CC_OP] = S_COMP;
+    t[S_COMP][CC_SEMI] = S_JUMP_BEGIN;
+    t[S_JUMP_BEGIN][CC_SYMBOL] = S_JUMP;
+    t[S_JUMP][CC_SYMBOL] = S_JUMP;
+    return t;
+}
+
+static constexpr CharClassTable charClasses = makeCharClasses();
+static constexpr DfaTable dfa = makeDfa();
+
+class Parser
+{
+public:
+    string_view source;
+    vector<LineSpan> lines;
+    size_t current;
+    string line;
+    uint32_t lineNumber;
+    // result of running the DFA over the current line
+    int type;
+    size_t eqPos;
+    size_t semiPos;
+    string error; // empty unless the line is malformed
+    bool numeric; // the A instruction is a constant, its value is in number
+    int number;
+
+    // the source is not copied, it must outlive the parser
+    Parser(const char *data, size_t size)
     {
-        inputFile.close();
+        source = string_view(data, size);
+        Scanner scanner;
+        scanner.scan(data, size, lines);
+        current = 0;
     }
 
     // check if there are more lines to read
     bool hasMoreLines()
     {
-        return !inputFile.eof();
+        return current < lines.size();
+    }
+
+    // start again from the first line
+    void reset()
+    {
+        current = 0;
     }
 
-    // gets the next line from the input file and make it the current line
+    // makes the next non-empty line the current line
     void advance()
     {
-        getline(inputFile, line);
-        // remove whitespace
-        trim(line);
+        const LineSpan &l = lines[current++];
+        line.assign(source.data() + l.begin, l.end - l.begin);
+        lineNumber = l.number;
+        // whitespace inside the instruction, e.g. "D = M"
+        if (!l.compact)
+            trim(line);
+        classify();
     }
 
     // returns the type of the current instruction
     int instructionType()
     {
-        if (line.find('@') != -1)
-            return A_INSTRUCTION;
-        else if (line.find('(') != -1 && line.find(')') != -1)
-            return L_INSTRUCTION;
-        else
-            return C_INSTRUCTION;
+        return type;
     }
 
     // returns the symbol of the current instruction
     // @xxx (xxx)
     string symbol()
     {
-        if (line.find('@') != -1)
+        if (type == A_INSTRUCTION)
         {
-            return line.substr(line.find('@') + 1);
+            return line.substr(1);
         }
-        return line.substr(line.find('(') + 1, line.find(')') - 1);
+        return line.substr(1, line.size() - 2);
     }
     // dest = comp;jump
     // comp;jump
     // comp
     string dest()
     {
-        return line.find('=') == -1 ? "null" : line.substr(0, line.find('='));
+        return eqPos == string::npos ? "null" : line.substr(0, eqPos);
     }
     string comp()
     {
-        if (line.find('=') == -1)
-        {
-            return line.find(';') == -1 ? line : line.substr(0, line.find(';'));
-        }
-        return line.find(';') == -1 ? line.substr(line.find('=') + 1) : line.substr(line.find('=') + 1, line.find(';') - line.find('=') - 1);
+        size_t begin = eqPos == string::npos ? 0 : eqPos + 1;
+        size_t end = semiPos == string::npos ? line.size() : semiPos;
+        return line.substr(begin, end - begin);
     }
     string jump()
     {
-        return line.find(';') == -1 ? "null" : line.substr(line.find(';') + 1);
+        return semiPos == string::npos ? "null" : line.substr(semiPos + 1);
     }
-};
 
-// removes all whitespace from the string
-void trim(string &s)
-{
-    int index = 0;
-    if (!s.empty())
+private:
+    // runs the DFA over the line once, classifying it and recording
+    // the '=' and ';' boundaries of a C instruction
+    void classify()
     {
-        while ((index = s.find(' ', index)) != -1)
+        eqPos = semiPos = string::npos;
+        error.clear();
+        number = 0;
+        uint8_t state = S_START;
+        size_t i = 0;
+        for (; i < line.size(); i++)
+        {
+            state = dfa[state][charClasses[(unsigned char)line[i]]];
+            if (state == S_A_NUMBER)
+                number = min(number * 10 + (line[i] - '0'), 32768); // saturate past the range
+            else if (state == S_COMP_BEGIN)
+                eqPos = i;
+            else if (state == S_JUMP_BEGIN)
+                semiPos = i;
+            else if (state == S_ERROR)
+                break;
+        }
+        numeric = state == S_A_NUMBER;
+        switch (state)
         {
-            s.erase(index, 1);
+        case S_A_NUMBER:
+            type = A_INSTRUCTION;
+            if (number > 32767)
+                error = "constant out of range";
+            break;
+        case S_A_SYMBOL:
+            type = A_INSTRUCTION;
+            break;
+        case S_L_END:
+            type = L_INSTRUCTION;
+            break;
+        case S_C_FIRST:
+        case S_COMP:
+        case S_JUMP:
+            type = C_INSTRUCTION;
+            break;
+        case S_ERROR:
+            type = C_INSTRUCTION;
+            error = string("unexpected character '") + line[i] + "'";
+            break;
+        default:
+            type = C_INSTRUCTION;
+            error = "incomplete instruction";
+            break;
         }
     }
-}
+};
 
-// check if all characters in the string are numbers
-bool AllisNum(string str)
+// removes all whitespace and the trailing // comment from the string
+// in a single pass, so the cost is linear in the length of the line
+void trim(string &s)
 {
-    for (int i = 0; i < str.size(); i++)
+    size_t n = s.size();
+    size_t out = 0;
+    for (size_t i = 0; i < n; i++)
     {
-        int tmp = (int)str[i];
-        if (tmp >= 48 && tmp <= 57)
-        {
+        char c = s[i];
+        if (c == '/' && i + 1 < n && s[i + 1] == '/')
+            break; // the rest of the line is a comment
+        if (c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == '\v' || c == '\f')
             continue;
-        }
-        else
-        {
-            return false;
-        }
+        s[out++] = c;
     }
-    return true;
+    s.resize(out);
 }
 
-// convert a string to a number
-// return 0 if the string is out of range
-int stonum(string str)
+// options that affect how a program is assembled
+struct Options
 {
-    int n = str.size();
-    if (n > 5)
-        return 0; // overflow
-    int num = 0;
-    for (int i = 0; i < n; i++)
+    size_t batch; // symbol references resolved per prefetch batch
+    Options()
     {
-        num = num * 10 + (int)str[i] - 48;
-        if (num > 32767)
-            return 0; // overflow
+        batch = 32;
     }
-    return num;
+};
+
+// where the words of an assembled program came from
+struct DebugInfo
+{
+    string source;                       // the file the lines are in
+    vector<uint32_t> lines;              // source line of each rom word
+    vector<pair<string, int>> labels;    // in order of definition
+    vector<pair<string, int>> variables; // in order of allocation
+};
+
+// reads a whole file into contents, returns false if it cannot be opened
+bool readFile(const string &fileName, string &contents)
+{
+    ifstream file(fileName, ios::binary);
+    if (!file)
+        return false;
+    file.seekg(0, ios::end);
+    streamoff size = file.tellg();
+    contents.resize(size > 0 ? (size_t)size : 0);
+    file.seekg(0, ios::beg);
+    file.read(&contents[0], contents.size());
+    return true;
 }
 
-int main(int argc, char *argv[])
+// reports a malformed current line or an unknown mnemonic in diagnostics,
+// returns false if there was one
+bool checkLine(Parser *parser, const Code *code, const string &name, string &diagnostics)
+{
+    string error = parser->error;
+    if (error.empty() && parser->instructionType() == C_INSTRUCTION)
+        error = code->check(parser->dest(), parser->comp(), parser->jump());
+    if (error.empty())
+        return true;
+    diagnostics += name + ":" + to_string(parser->lineNumber) + ": error: " + error + ": " + parser->line + "\n";
+    return false;
+}
+
+// assembles the source text into rom, one word per instruction
+// errors are appended to diagnostics as "name:line: error: ..." lines
+bool assemble(string_view source, const string &name, const Options &options, vector<uint16_t> &rom, string &diagnostics,
+              DebugInfo *debug = nullptr)
 {
-    string inputFileName = argv[1]; // input file name
-    string outputFileName = argv[2]; // output file name
-    ofstream outputFile(outputFileName);
-    Parser *parser = new Parser(inputFileName);
+    rom.clear();
+    if (debug)
+    {
+        *debug = DebugInfo();
+        debug->source = name;
+    }
+    // the code tables never change, build them once per process
+    static const Code codeTables;
+    const Code *code = &codeTables;
+    Parser *parser = new Parser(source.data(), source.size());
     SymbolTable *symbolTable = new SymbolTable();
-    Code *code = new Code();
 
-    // initialize label address
+    // initialize label address and report malformed lines
     int address = 0; // next instruction address
+    int errors = 0;
     while (parser->hasMoreLines())
     {
         parser->advance();
-        // ignore empty lines and comments
-        if (parser->line.empty() || parser->line.find("//") != -1)
-            continue;
+        if (!checkLine(parser, code, name, diagnostics))
+            errors++;
         if (parser->instructionType() == L_INSTRUCTION)
         {
             string symbol = parser->symbol();
             if (!symbolTable->contains(symbol))
             {
                 symbolTable->addEntry(symbol, address);
+                if (debug)
+                    debug->labels.push_back(make_pair(symbol, address));
             }
         }
         else // A_INSTRUCTION or C_INSTRUCTION
@@ -319,77 +1127,5772 @@ int main(int argc, char *argv[])
             address = address + 1;
         }
     }
-    delete parser;
+
+    if (errors > 0)
+    {
+        delete parser;
+        delete symbolTable;
+        return false;
+    }
 
     // initialize variable address
-    parser = new Parser(inputFileName);
+    parser->reset();
     address = 16; // next variable address
     while (parser->hasMoreLines())
     {
         parser->advance();
-        // ignore empty lines and comments
-        if (parser->line.empty() || parser->line.find("//") != -1)
-            continue;
-        if (parser->instructionType() == A_INSTRUCTION)
+        // constants are encoded directly and never enter the table
+        if (parser->instructionType() == A_INSTRUCTION && !parser->numeric)
         {
             string symbol = parser->symbol();
             if (!symbolTable->contains(symbol))
             {
-                // if the symbol is a number, add it to the symbol table directly
-                if (AllisNum(symbol))
-                {
-                    symbolTable->addEntry(symbol, stonum(symbol));
-                }
-                else
-                {
-                    symbolTable->addEntry(symbol, address);
-                    address = address + 1;
-                }
+                symbolTable->addEntry(symbol, address);
+                if (debug)
+                    debug->variables.push_back(make_pair(symbol, address));
+                address = address + 1;
             }
         }
     }
-    delete parser;
 
-    // generate binary code
-    parser = new Parser(inputFileName);
-    string binaryCode = "";
+    // the table is complete, switch it to the frozen form for encoding
+    bool frozen = symbolTable->freeze();
+
+    // encode every instruction into the rom; symbolic A instructions are
+    // collected and resolved afterwards in batches
+    vector<SymbolRef> refs;
+    parser->reset();
     while (parser->hasMoreLines())
     {
-        // clear binary code for each instruction
-        binaryCode.clear();
         parser->advance();
-        // ignore empty lines and comments
-        if (parser->line.empty() || parser->line.find("//") != -1)
-            continue;
         if (parser->instructionType() == A_INSTRUCTION)
         {
-            string symbol = parser->symbol();
-            int address = symbolTable->getAddress(symbol);
-            for (int i = 0; i < 15; i++)
+            int address = parser->number;
+            if (!parser->numeric)
             {
-                binaryCode = to_string((address >> i) & 1) + binaryCode;
+                string_view symbol = string_view(parser->line).substr(1);
+                address = predefinedAddress(symbol);
+                if (address < 0 && !frozen)
+                    address = symbolTable->getAddress(string(symbol)) & 0x7FFF;
+                else if (address < 0)
+                {
+                    SymbolRef ref;
+                    ref.hash = hashSymbol(symbol.data(), symbol.size());
+                    ref.index = (uint32_t)rom.size();
+                    refs.push_back(ref);
+                    address = 0;
+                }
             }
-            binaryCode = "0" + binaryCode;
+            rom.push_back((uint16_t)address);
         }
         else if (parser->instructionType() == C_INSTRUCTION)
         {
-            string dest = parser->dest();
-            string comp = parser->comp();
-            string jump = parser->jump();
-            binaryCode = "111" + code->comp(comp) + code->dest(dest) + code->jump(jump);
-        }
-        if (!binaryCode.empty())
-        {
-            outputFile << binaryCode << endl; // write binary code to file
-            outputFile.flush();               // write to file immediately
+            rom.push_back(code->word(parser->dest(), parser->comp(), parser->jump()));
         }
+        if (debug && debug->lines.size() < rom.size())
+            debug->lines.push_back(parser->lineNumber);
     }
+    symbolTable->resolve(refs, rom, options.batch);
 
-    // close file and delete objects
     delete parser;
     delete symbolTable;
-    delete code;
-    outputFile.flush();
-    outputFile.close();
-    return 0;
+    return true;
+}
+
+
+// formats the rom as the text of a .hack file, 16 binary digits per line
+// out must have room for 17 bytes per word
+void formatHack(const vector<uint16_t> &rom, char *out)
+{
+    for (size_t i = 0; i < rom.size(); i++)
+    {
+        for (int bit = 0; bit < 16; bit++)
+        {
+            out[i * 17 + bit] = (rom[i] >> (15 - bit)) & 1 ? '1' : '0';
+        }
+        out[i * 17 + 16] = '\n';
+    }
+}
+
+string hackText(const vector<uint16_t> &rom)
+{
+    string binaryCode(rom.size() * 17, '\n');
+    formatHack(rom, &binaryCode[0]);
+    return binaryCode;
+}
+
+// writes text to a file, returns false on failure
+bool writeFile(const string &fileName, string_view text)
+{
+    ofstream file(fileName, ios::binary);
+    file.write(text.data(), text.size());
+    return (bool)file;
+}
+
+// debug file layout, read in one pass from a mapping. Integers are in
+// host byte order:
+//   DebugHeader
+//   DebugSymbolEntry[labelCount + variableCount]  labels first, in order
+//   uint8_t[lineSize]   the source line of each word, as the difference
+//                       from the line of the word before it, zigzag LEB128
+//   char[sourceSize]    the name of the assembled file
+//   char[nameSize]      symbol names, back to back
+struct DebugHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t wordCount;
+    uint32_t labelCount;
+    uint32_t variableCount;
+    uint32_t lineSize;
+    uint32_t sourceSize;
+    uint32_t nameSize;
+};
+
+struct DebugSymbolEntry
+{
+    uint32_t address;
+    uint32_t nameLength;
+};
+
+#define DEBUG_MAGIC 0x47424448u // "HDBG"
+#define DEBUG_VERSION 1
+
+bool writeDebugInfo(const string &fileName, const DebugInfo &debug)
+{
+    DebugHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = DEBUG_MAGIC;
+    header.version = DEBUG_VERSION;
+    header.wordCount = (uint32_t)debug.lines.size();
+    header.labelCount = (uint32_t)debug.labels.size();
+    header.variableCount = (uint32_t)debug.variables.size();
+    header.sourceSize = (uint32_t)debug.source.size();
+
+    string out((const char *)&header, sizeof(header));
+    string names;
+    for (const vector<pair<string, int>> *table : {&debug.labels, &debug.variables})
+    {
+        for (const pair<string, int> &symbol : *table)
+        {
+            DebugSymbolEntry entry{(uint32_t)symbol.second, (uint32_t)symbol.first.size()};
+            out.append((const char *)&entry, sizeof(entry));
+            names += symbol.first;
+        }
+    }
+    // lines mostly grow by one or two, so most words take a single byte
+    size_t lineStart = out.size();
+    uint32_t previous = 0;
+    for (uint32_t line : debug.lines)
+    {
+        int64_t delta = (int64_t)line - previous;
+        uint64_t zigzag = delta < 0 ? ((uint64_t)-delta << 1) - 1 : (uint64_t)delta << 1;
+        while (zigzag >= 0x80)
+        {
+            out += (char)(zigzag | 0x80);
+            zigzag >>= 7;
+        }
+        out += (char)zigzag;
+        previous = line;
+    }
+    header.lineSize = (uint32_t)(out.size() - lineStart);
+    header.nameSize = (uint32_t)names.size();
+    out += debug.source;
+    out += names;
+    memcpy(&out[0], &header, sizeof(header));
+    return writeFile(fileName, out);
+}
+
+// reads a file written by writeDebugInfo, checking every section against
+// the file size
+bool readDebugInfo(const string &fileName, DebugInfo &debug, string &diagnostics)
+{
+    debug = DebugInfo();
+    const char *data = nullptr;
+    size_t size = 0;
+    string contents;
+#ifdef __linux__
+    int fd = ::open(fileName.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat info;
+    void *map = MAP_FAILED;
+    if (fd >= 0 && fstat(fd, &info) == 0 && info.st_size > 0)
+        map = mmap(nullptr, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (fd >= 0)
+        close(fd);
+    if (map != MAP_FAILED)
+    {
+        data = (const char *)map;
+        size = (size_t)info.st_size;
+    }
+#endif
+    if (!data)
+    {
+        if (!readFile(fileName, contents))
+        {
+            diagnostics += fileName + ": error: cannot open file\n";
+            return false;
+        }
+        data = contents.data();
+        size = contents.size();
+    }
+
+    DebugHeader header;
+    bool ok = size >= sizeof(header);
+    if (ok)
+    {
+        memcpy(&header, data, sizeof(header));
+        uint64_t symbols = (uint64_t)header.labelCount + header.variableCount;
+        ok = header.magic == DEBUG_MAGIC && header.version == DEBUG_VERSION &&
+             sizeof(header) + symbols * sizeof(DebugSymbolEntry) + header.lineSize + header.sourceSize + header.nameSize == size;
+    }
+    if (ok)
+    {
+        const char *entries = data + sizeof(header);
+        const uint8_t *line = (const uint8_t *)entries + ((size_t)header.labelCount + header.variableCount) * sizeof(DebugSymbolEntry);
+        const uint8_t *lineEnd = line + header.lineSize;
+        const char *names = (const char *)lineEnd + header.sourceSize;
+        debug.source.assign((const char *)lineEnd, header.sourceSize);
+
+        size_t nameOffset = 0;
+        for (uint32_t i = 0; ok && i < header.labelCount + header.variableCount; i++)
+        {
+            DebugSymbolEntry entry;
+            memcpy(&entry, entries + i * sizeof(entry), sizeof(entry));
+            ok = entry.nameLength <= header.nameSize - nameOffset;
+            if (!ok)
+                break;
+            vector<pair<string, int>> &table = i < header.labelCount ? debug.labels : debug.variables;
+            table.push_back(make_pair(string(names + nameOffset, entry.nameLength), (int)entry.address));
+            nameOffset += entry.nameLength;
+        }
+
+        debug.lines.reserve(header.wordCount);
+        uint32_t previous = 0;
+        while (ok && line < lineEnd && debug.lines.size() < header.wordCount)
+        {
+            uint64_t zigzag = 0;
+            for (int shift = 0; line < lineEnd && shift < 64; shift += 7)
+            {
+                zigzag |= (uint64_t)(*line & 0x7F) << shift;
+                if (!(*line++ & 0x80))
+                    break;
+            }
+            int64_t delta = zigzag & 1 ? -(int64_t)(zigzag >> 1) - 1 : (int64_t)(zigzag >> 1);
+            previous = (uint32_t)(previous + delta);
+            debug.lines.push_back(previous);
+        }
+        ok = ok && line == lineEnd && debug.lines.size() == header.wordCount;
+    }
+#ifdef __linux__
+    if (contents.empty() && data)
+        munmap((void *)data, size);
+#endif
+    if (!ok)
+    {
+        diagnostics += fileName + ": error: not a valid debug file\n";
+        debug = DebugInfo();
+    }
+    return ok;
+}
+
+// fixed set of worker threads running queued jobs
+class ThreadPool
+{
+public:
+    ThreadPool(size_t threads)
+    {
+        running = 0;
+        stopping = false;
+        for (size_t i = 0; i < max((size_t)1, threads); i++)
+            workers.push_back(thread([this] { work(); }));
+    }
+    ~ThreadPool()
+    {
+        {
+            lock_guard<mutex> guard(lock);
+            stopping = true;
+        }
+        ready.notify_all();
+        for (thread &t : workers)
+            t.join();
+    }
+
+    void submit(function<void()> job)
+    {
+        {
+            lock_guard<mutex> guard(lock);
+            jobs.push_back(move(job));
+        }
+        ready.notify_one();
+    }
+
+    // blocks until every submitted job has finished
+    void wait()
+    {
+        unique_lock<mutex> guard(lock);
+        idle.wait(guard, [this] { return jobs.empty() && running == 0; });
+    }
+
+    size_t size()
+    {
+        return workers.size();
+    }
+
+    // runs body(i) for i in [0, n) spread over the workers and waits for it
+    void parallelFor(size_t n, function<void(size_t)> body)
+    {
+        size_t chunks = min(n, workers.size() * 4);
+        for (size_t c = 0; c < chunks; c++)
+        {
+            submit([c, chunks, n, &body] {
+                for (size_t i = c * n / chunks; i < (c + 1) * n / chunks; i++)
+                    body(i);
+            });
+        }
+        wait();
+    }
+
+private:
+    vector<thread> workers;
+    deque<function<void()>> jobs;
+    mutex lock;
+    condition_variable ready;
+    condition_variable idle;
+    size_t running;
+    bool stopping;
+
+    void work()
+    {
+        unique_lock<mutex> guard(lock);
+        for (;;)
+        {
+            ready.wait(guard, [this] { return stopping || !jobs.empty(); });
+            if (jobs.empty())
+                return;
+            function<void()> job = move(jobs.front());
+            jobs.pop_front();
+            running++;
+            guard.unlock();
+            job();
+            guard.lock();
+            running--;
+            if (jobs.empty() && running == 0)
+                idle.notify_all();
+        }
+    }
+};
+
+// a symbol of an object module: a label it defines (address is its
+// offset in the module) or a name it uses but does not define (address
+// is UNDEFINED), which the linker binds to another module's label or
+// to a variable
+struct ObjectSymbol
+{
+    string name;
+    int32_t address;
+};
+
+#define UNDEFINED -1
+
+// the word at index must be patched with the address of symbol
+struct Relocation
+{
+    uint32_t index;
+    uint32_t symbol;
+};
+
+// relocatable output of assembling one module
+struct ObjectModule
+{
+    vector<uint16_t> code;
+    vector<ObjectSymbol> symbols; // labels in definition order, then imports in order of first use
+    vector<Relocation> relocations;
+};
+
+#define OBJECT_MAGIC 0x4A424F48u // "HOBJ"
+#define OBJECT_VERSION 2
+
+// assembles one module into an object: constants, predefined symbols and
+// C instructions are encoded, every other symbol is left to the linker
+bool assembleObject(string_view source, const string &name, ObjectModule &module, string &diagnostics)
+{
+    static const Code codeTables;
+    const Code *code = &codeTables;
+    module = ObjectModule();
+    Parser parser(source.data(), source.size());
+    unordered_map<string, uint32_t> symbolIndex;
+
+    // labels and their offsets, and malformed lines
+    int address = 0;
+    int errors = 0;
+    while (parser.hasMoreLines())
+    {
+        parser.advance();
+        if (!checkLine(&parser, code, name, diagnostics))
+            errors++;
+        if (parser.instructionType() == L_INSTRUCTION)
+        {
+            string symbol = parser.symbol();
+            if (predefinedAddress(symbol) >= 0 || symbolIndex.count(symbol))
+                continue;
+            symbolIndex[symbol] = (uint32_t)module.symbols.size();
+            module.symbols.push_back(ObjectSymbol{symbol, address});
+        }
+        else
+        {
+            address = address + 1;
+        }
+    }
+    if (errors > 0)
+        return false;
+
+    parser.reset();
+    while (parser.hasMoreLines())
+    {
+        parser.advance();
+        if (parser.instructionType() == A_INSTRUCTION)
+        {
+            int value = parser.number;
+            if (!parser.numeric && (value = predefinedAddress(string_view(parser.line).substr(1))) < 0)
+            {
+                string symbol = parser.symbol();
+                auto it = symbolIndex.find(symbol);
+                if (it == symbolIndex.end())
+                {
+                    it = symbolIndex.insert(make_pair(symbol, (uint32_t)module.symbols.size())).first;
+                    module.symbols.push_back(ObjectSymbol{symbol, UNDEFINED});
+                }
+                module.relocations.push_back(Relocation{(uint32_t)module.code.size(), it->second});
+                value = 0;
+            }
+            module.code.push_back((uint16_t)value);
+        }
+        else if (parser.instructionType() == C_INSTRUCTION)
+        {
+            module.code.push_back(code->word(parser.dest(), parser.comp(), parser.jump()));
+        }
+    }
+    return true;
+}
+
+// object file layout, designed to be mapped and used in place. Integers
+// are in host byte order and every section starts 8-byte aligned:
+//   ObjectHeader
+//   ObjectSymbolEntry[symbolCount]  labels first, then imports, each with
+//                                   the hash of its name precomputed
+//   Relocation[relocationCount]
+//   uint16_t[codeCount]             the code words
+//   char[stringSize]                symbol names
+struct ObjectHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t codeCount;
+    uint32_t symbolCount;
+    uint32_t relocationCount;
+    uint32_t reserved;
+    uint64_t symbolOffset;
+    uint64_t relocationOffset;
+    uint64_t codeOffset;
+    uint64_t stringOffset;
+    uint64_t stringSize;
+};
+
+struct ObjectSymbolEntry
+{
+    uint64_t hash; // hashSymbol of the name
+    uint32_t nameOffset;
+    uint32_t nameLength;
+    int32_t address; // UNDEFINED for imports
+    uint32_t reserved;
+};
+
+static size_t alignTo8(size_t n)
+{
+    return (n + 7) & ~(size_t)7;
+}
+
+bool writeObject(const string &fileName, const ObjectModule &module)
+{
+    ObjectHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = OBJECT_MAGIC;
+    header.version = OBJECT_VERSION;
+    header.codeCount = (uint32_t)module.code.size();
+    header.symbolCount = (uint32_t)module.symbols.size();
+    header.relocationCount = (uint32_t)module.relocations.size();
+    header.symbolOffset = alignTo8(sizeof(ObjectHeader));
+    header.relocationOffset = alignTo8(header.symbolOffset + header.symbolCount * sizeof(ObjectSymbolEntry));
+    header.codeOffset = alignTo8(header.relocationOffset + header.relocationCount * sizeof(Relocation));
+    header.stringOffset = alignTo8(header.codeOffset + header.codeCount * sizeof(uint16_t));
+    for (const ObjectSymbol &symbol : module.symbols)
+        header.stringSize += symbol.name.size();
+
+    string out(header.stringOffset + header.stringSize, '\0');
+    char *base = &out[0];
+    memcpy(base, &header, sizeof(header));
+    ObjectSymbolEntry *entries = (ObjectSymbolEntry *)(base + header.symbolOffset);
+    uint32_t nameOffset = 0;
+    for (uint32_t i = 0; i < header.symbolCount; i++)
+    {
+        const ObjectSymbol &symbol = module.symbols[i];
+        ObjectSymbolEntry &entry = entries[i];
+        entry.hash = hashSymbol(symbol.name.data(), symbol.name.size());
+        entry.nameOffset = nameOffset;
+        entry.nameLength = (uint32_t)symbol.name.size();
+        entry.address = symbol.address;
+        entry.reserved = 0;
+        memcpy(base + header.stringOffset + nameOffset, symbol.name.data(), symbol.name.size());
+        nameOffset += entry.nameLength;
+    }
+    memcpy(base + header.relocationOffset, module.relocations.data(), header.relocationCount * sizeof(Relocation));
+    memcpy(base + header.codeOffset, module.code.data(), header.codeCount * sizeof(uint16_t));
+    return writeFile(fileName, out);
+}
+
+// an object file mapped read-only and used in place, nothing is decoded
+class MappedObject
+{
+public:
+    string fileName;
+    const ObjectHeader *header;
+    const ObjectSymbolEntry *symbols;
+    const Relocation *relocations;
+    const uint16_t *code;
+    const char *strings;
+
+    MappedObject()
+    {
+        data = nullptr;
+        size = 0;
+        mapped = false;
+        header = nullptr;
+    }
+    ~MappedObject()
+    {
+#ifdef __linux__
+        if (mapped)
+            munmap((void *)data, size);
+#endif
+    }
+    MappedObject(const MappedObject &) = delete;
+    MappedObject &operator=(const MappedObject &) = delete;
+
+    bool open(const string &name, string &diagnostics)
+    {
+        fileName = name;
+#ifdef __linux__
+        int fd = ::open(name.c_str(), O_RDONLY | O_CLOEXEC);
+        struct stat info;
+        if (fd >= 0 && fstat(fd, &info) == 0 && info.st_size > 0)
+        {
+            void *map = mmap(nullptr, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (map != MAP_FAILED)
+            {
+                data = (const char *)map;
+                size = (size_t)info.st_size;
+                mapped = true;
+            }
+        }
+        if (fd >= 0)
+            close(fd);
+#endif
+        if (!mapped)
+        {
+            // no mmap here, read into 8-byte aligned memory instead
+            string contents;
+            if (!readFile(name, contents))
+            {
+                diagnostics += name + ": error: cannot open file\n";
+                return false;
+            }
+            buffer.resize(contents.size() / 8 + 1);
+            memcpy(buffer.data(), contents.data(), contents.size());
+            data = (const char *)buffer.data();
+            size = contents.size();
+        }
+        if (!valid())
+        {
+            diagnostics += name + ": error: not a valid object file\n";
+            return false;
+        }
+        return true;
+    }
+
+    string_view name(uint32_t symbol) const
+    {
+        return string_view(strings + symbols[symbol].nameOffset, symbols[symbol].nameLength);
+    }
+
+private:
+    const char *data;
+    size_t size;
+    bool mapped;
+    vector<uint64_t> buffer;
+
+    // checks that every section lies inside the file
+    bool valid()
+    {
+        if (size < sizeof(ObjectHeader))
+            return false;
+        header = (const ObjectHeader *)data;
+        const ObjectHeader &h = *header;
+        auto fits = [this](uint64_t offset, uint64_t bytes) { return offset % 8 == 0 && offset <= size && bytes <= size - offset; };
+        if (h.magic != OBJECT_MAGIC || h.version != OBJECT_VERSION ||
+            !fits(h.symbolOffset, (uint64_t)h.symbolCount * sizeof(ObjectSymbolEntry)) ||
+            !fits(h.relocationOffset, (uint64_t)h.relocationCount * sizeof(Relocation)) ||
+            !fits(h.codeOffset, (uint64_t)h.codeCount * sizeof(uint16_t)) || !fits(h.stringOffset, h.stringSize))
+            return false;
+        symbols = (const ObjectSymbolEntry *)(data + h.symbolOffset);
+        relocations = (const Relocation *)(data + h.relocationOffset);
+        code = (const uint16_t *)(data + h.codeOffset);
+        strings = data + h.stringOffset;
+        for (uint32_t i = 0; i < h.symbolCount; i++)
+        {
+            if ((uint64_t)symbols[i].nameOffset + symbols[i].nameLength > h.stringSize)
+                return false;
+        }
+        for (uint32_t i = 0; i < h.relocationCount; i++)
+        {
+            if (relocations[i].index >= h.codeCount || relocations[i].symbol >= h.symbolCount)
+                return false;
+        }
+        return true;
+    }
+};
+
+// global symbol table of the linker: open addressing over names that
+// point into the mapped objects, keyed by the hashes stored in them
+class LinkTable
+{
+public:
+    struct Entry
+    {
+        uint64_t hash;
+        string_view name;
+        int value;
+        uint32_t module;
+    };
+
+    LinkTable(size_t expected)
+    {
+        size_t n = 16;
+        while (n < expected * 2)
+            n *= 2;
+        entries.assign(n, Entry{0, string_view(), -1, 0});
+        count = 0;
+    }
+
+    // inserts name unless present; returns the entry holding it
+    Entry &insert(uint64_t hash, string_view name, int value, uint32_t module)
+    {
+        if ((count + 1) * 2 > entries.size())
+            grow();
+        Entry &e = slot(hash, name);
+        if (e.value < 0)
+        {
+            e = Entry{hash, name, value, module};
+            count++;
+        }
+        return e;
+    }
+
+    const Entry *find(uint64_t hash, string_view name)
+    {
+        Entry &e = slot(hash, name);
+        return e.value < 0 ? nullptr : &e;
+    }
+
+private:
+    vector<Entry> entries; // value < 0 marks an empty entry
+    size_t count;
+
+    Entry &slot(uint64_t hash, string_view name)
+    {
+        size_t mask = entries.size() - 1;
+        for (size_t i = hash & mask;; i = (i + 1) & mask)
+        {
+            Entry &e = entries[i];
+            if (e.value < 0 || (e.hash == hash && e.name == name))
+                return e;
+        }
+    }
+
+    void grow()
+    {
+        vector<Entry> old;
+        old.swap(entries);
+        entries.assign(old.size() * 2, Entry{0, string_view(), -1, 0});
+        for (const Entry &e : old)
+        {
+            if (e.value >= 0)
+                slot(e.hash, e.name) = e;
+        }
+    }
+};
+
+// LinkTable split into shards by hash, each behind its own lock, so
+// threads can insert into it concurrently
+class ConcurrentLinkTable
+{
+public:
+    ConcurrentLinkTable(size_t expected)
+    {
+        for (size_t i = 0; i < SHARDS; i++)
+            shards.push_back(new Shard(expected / SHARDS + 1));
+    }
+    ~ConcurrentLinkTable()
+    {
+        for (Shard *shard : shards)
+            delete shard;
+    }
+
+    // inserts a label; of several definitions the one from the lowest
+    // module wins, whatever order the threads arrive in
+    void define(uint64_t hash, string_view name, int value, uint32_t module)
+    {
+        Shard &shard = *shards[hash >> (64 - SHARD_BITS)];
+        lock_guard<mutex> guard(shard.lock);
+        LinkTable::Entry &e = shard.table.insert(hash, name, value, module);
+        if (module < e.module)
+        {
+            e.value = value;
+            e.module = module;
+        }
+    }
+
+    // only safe once all inserts are done
+    const LinkTable::Entry *find(uint64_t hash, string_view name)
+    {
+        return shards[hash >> (64 - SHARD_BITS)]->table.find(hash, name);
+    }
+
+private:
+    enum
+    {
+        SHARD_BITS = 6,
+        SHARDS = 1 << SHARD_BITS
+    };
+    struct Shard
+    {
+        mutex lock;
+        LinkTable table;
+        Shard(size_t expected) : table(expected) {}
+    };
+    vector<Shard *> shards;
+};
+
+// links modules in the given order into one rom: module code is laid out
+// back to back, labels become global addresses and names no module
+// defines become variables from 16 in order of first use, as if the
+// modules had been assembled as one file. Labels are collected and
+// relocations applied one module per task; only the numbering of the
+// variables runs serially, so the output does not depend on the pool size.
+bool link(const vector<MappedObject *> &modules, ThreadPool &pool, vector<uint16_t> &rom, string &diagnostics)
+{
+    size_t count = modules.size();
+    size_t symbolCount = 0;
+    vector<size_t> base(count + 1, 0);
+    for (size_t m = 0; m < count; m++)
+    {
+        base[m + 1] = base[m] + modules[m]->header->codeCount;
+        symbolCount += modules[m]->header->symbolCount;
+    }
+
+    ConcurrentLinkTable labels(symbolCount);
+    pool.parallelFor(count, [&](size_t m) {
+        const MappedObject &module = *modules[m];
+        for (uint32_t i = 0; i < module.header->symbolCount; i++)
+        {
+            const ObjectSymbolEntry &symbol = module.symbols[i];
+            if (symbol.address == UNDEFINED)
+                break; // imports follow the labels
+            labels.define(symbol.hash, module.name(i), (int)(base[m] + symbol.address), (uint32_t)m);
+        }
+    });
+
+    // resolve against the labels; names left over are variables
+    vector<string> errors(count);
+    vector<vector<int>> resolved(count);
+    pool.parallelFor(count, [&](size_t m) {
+        const MappedObject &module = *modules[m];
+        resolved[m].assign(module.header->symbolCount, -1);
+        for (uint32_t i = 0; i < module.header->symbolCount; i++)
+        {
+            const ObjectSymbolEntry &symbol = module.symbols[i];
+            const LinkTable::Entry *label = labels.find(symbol.hash, module.name(i));
+            if (!label)
+                continue;
+            if (symbol.address != UNDEFINED && label->module != m)
+            {
+                errors[m] += module.fileName + ": error: duplicate symbol '" + string(module.name(i)) +
+                             "', first defined in " + modules[label->module]->fileName + "\n";
+            }
+            resolved[m][i] = label->value;
+        }
+    });
+    bool ok = true;
+    for (size_t m = 0; m < count; m++)
+    {
+        diagnostics += errors[m];
+        ok = ok && errors[m].empty();
+    }
+    if (!ok)
+        return false;
+
+    LinkTable variables(64);
+    int nextVariable = 16;
+    for (size_t m = 0; m < count; m++)
+    {
+        const MappedObject &module = *modules[m];
+        for (uint32_t i = 0; i < module.header->symbolCount; i++)
+        {
+            if (resolved[m][i] >= 0)
+                continue;
+            LinkTable::Entry &variable = variables.insert(module.symbols[i].hash, module.name(i), nextVariable, (uint32_t)m);
+            if (variable.value == nextVariable)
+                nextVariable++;
+            resolved[m][i] = variable.value;
+        }
+    }
+
+    rom.assign(base[count], 0);
+    pool.parallelFor(count, [&](size_t m) {
+        const MappedObject &module = *modules[m];
+        copy(module.code, module.code + module.header->codeCount, rom.begin() + base[m]);
+        for (uint32_t r = 0; r < module.header->relocationCount; r++)
+        {
+            const Relocation &relocation = module.relocations[r];
+            rom[base[m] + relocation.index] = (uint16_t)(resolved[m][relocation.symbol] & 0x7FFF);
+        }
+    });
+    return true;
+}
+
+// the emulator runs a rom on the Hack CPU. Every 16-bit word is decoded
+// once into a micro-op; loading a program copies the ops of its words,
+// so running never looks at instruction bits again.
+
+#define ROM_SIZE 32768
+#define RAM_SIZE 32768
+#define DEFAULT_CYCLES 1000000000ull
+
+// micro-op handlers: loading A, the documented computations (y is A or
+// M), any other ALU control bits, and the halt loop
+enum
+{
+    OP_LOAD,
+    OP_ZERO,
+    OP_ONE,
+    OP_MINUS_ONE,
+    OP_D,
+    OP_A,
+    OP_M,
+    OP_NOT_D,
+    OP_NOT_A,
+    OP_NOT_M,
+    OP_NEG_D,
+    OP_NEG_A,
+    OP_NEG_M,
+    OP_D_PLUS_ONE,
+    OP_A_PLUS_ONE,
+    OP_M_PLUS_ONE,
+    OP_D_MINUS_ONE,
+    OP_A_MINUS_ONE,
+    OP_M_MINUS_ONE,
+    OP_D_PLUS_A,
+    OP_D_PLUS_M,
+    OP_D_MINUS_A,
+    OP_D_MINUS_M,
+    OP_A_MINUS_D,
+    OP_M_MINUS_D,
+    OP_D_AND_A,
+    OP_D_AND_M,
+    OP_D_OR_A,
+    OP_D_OR_M,
+    OP_ALU,
+    OP_HALT,
+    OP_COUNT
+};
+
+struct alignas(8) MicroOp
+{
+    uint8_t handler;
+    uint8_t dest;   // 4 = A, 2 = D, 1 = M
+    uint8_t jump;   // 1 jumps if > 0, 2 if = 0, 4 if < 0
+    uint8_t alu;    // the a bit and c1..c6, for OP_ALU
+    uint16_t value; // the constant of OP_LOAD
+};
+
+// the hardware ALU, x is D and y is A or M
+static inline uint16_t aluCompute(uint8_t alu, uint16_t x, uint16_t y)
+{
+    if (alu & 32)
+        x = 0;
+    if (alu & 16)
+        x = ~x;
+    if (alu & 8)
+        y = 0;
+    if (alu & 4)
+        y = ~y;
+    uint16_t r = (alu & 2) ? (uint16_t)(x + y) : (uint16_t)(x & y);
+    return (alu & 1) ? (uint16_t)~r : r;
+}
+
+// the micro-op of every 16-bit word
+static const MicroOp *decodeTable()
+{
+    // c1..c6 of the documented computations and their handlers for y = A and y = M
+    static const struct
+    {
+        uint8_t bits;
+        uint8_t withA;
+        uint8_t withM;
+    } documented[] = {
+        {0x2A, OP_ZERO, OP_ZERO},
+        {0x3F, OP_ONE, OP_ONE},
+        {0x3A, OP_MINUS_ONE, OP_MINUS_ONE},
+        {0x0C, OP_D, OP_D},
+        {0x30, OP_A, OP_M},
+        {0x0D, OP_NOT_D, OP_NOT_D},
+        {0x31, OP_NOT_A, OP_NOT_M},
+        {0x0F, OP_NEG_D, OP_NEG_D},
+        {0x33, OP_NEG_A, OP_NEG_M},
+        {0x1F, OP_D_PLUS_ONE, OP_D_PLUS_ONE},
+        {0x37, OP_A_PLUS_ONE, OP_M_PLUS_ONE},
+        {0x0E, OP_D_MINUS_ONE, OP_D_MINUS_ONE},
+        {0x32, OP_A_MINUS_ONE, OP_M_MINUS_ONE},
+        {0x02, OP_D_PLUS_A, OP_D_PLUS_M},
+        {0x13, OP_D_MINUS_A, OP_D_MINUS_M},
+        {0x07, OP_A_MINUS_D, OP_M_MINUS_D},
+        {0x00, OP_D_AND_A, OP_D_AND_M},
+        {0x15, OP_D_OR_A, OP_D_OR_M},
+    };
+    static vector<MicroOp> table;
+    static once_flag built;
+    call_once(built, [] {
+        table.resize(65536);
+        for (uint32_t w = 0; w < 65536; w++)
+        {
+            MicroOp &op = table[w];
+            if (!(w & 0x8000))
+            {
+                op = MicroOp{OP_LOAD, 0, 0, 0, (uint16_t)w};
+                continue;
+            }
+            // bits 13 and 14 are unused, the CPU ignores them
+            op = MicroOp{OP_ALU, (uint8_t)((w >> 3) & 7), (uint8_t)(w & 7), (uint8_t)((w >> 6) & 0x7F), 0};
+            for (auto &c : documented)
+            {
+                if (c.bits == (op.alu & 0x3F))
+                    op.handler = (op.alu & 0x40) ? c.withM : c.withA;
+            }
+        }
+    });
+    return table.data();
+}
+
+// an emulator probe sees the pc, A and D before every instruction runs
+// and can stop the run there by returning true, sees every RAM write, and
+// the pc of the halt loop when the program halts there (that step is not
+// a cycle); this one sees nothing and compiles away
+struct NoProbe
+{
+    bool step(uint32_t /*pc*/, uint32_t /*a*/, uint32_t /*d*/)
+    {
+        return false;
+    }
+    void write(uint32_t /*address*/, uint16_t /*value*/)
+    {
+    }
+    void halt(uint32_t /*pc*/)
+    {
+    }
+};
+
+// counts the cycles spent at each ROM address
+struct CycleProfile
+{
+    vector<uint64_t> counts;
+
+    CycleProfile() : counts(ROM_SIZE)
+    {
+    }
+    bool step(uint32_t pc, uint32_t /*a*/, uint32_t /*d*/)
+    {
+        counts[pc]++;
+        return false;
+    }
+    void write(uint32_t /*address*/, uint16_t /*value*/)
+    {
+    }
+    void halt(uint32_t pc)
+    {
+        counts[pc]--;
+    }
+};
+
+#define TRACE_WRITE (1ull << 63) // marks a RAM write in the trace
+#define TRACE_SLICE (1u << 20)   // cycles run between looks for a signal
+
+// set by the signal handler during a traced run, polled between slices
+volatile sig_atomic_t traceSignal = 0;
+
+void onTraceSignal(int number)
+{
+    traceSignal = number;
+}
+
+// keeps the last steps of a run in a ring of 64-bit words: the pc, A and
+// D before each instruction, followed by the RAM address and value if it
+// wrote one. One store per step is all the interpreter pays; decoding,
+// labels and lines are left to dump. Stops the run before an address
+// marked in breakpoints.
+class TraceBuffer
+{
+public:
+    vector<uint8_t> breakpoints; // nonzero at addresses to stop before
+    bool stoppedAtBreakpoint;
+
+    // size is in bytes, rounded down to a power of two words
+    TraceBuffer(size_t size) : breakpoints(ROM_SIZE)
+    {
+        size_t words = 2;
+        while (words * 2 * sizeof(uint64_t) <= size)
+            words *= 2;
+        ring.resize(words);
+        mask = words - 1;
+        next = 0;
+        stoppedAtBreakpoint = false;
+    }
+
+    ALWAYS_INLINE bool step(uint32_t pc, uint32_t a, uint32_t d)
+    {
+        if (breakpoints[pc])
+        {
+            stoppedAtBreakpoint = true;
+            return true;
+        }
+        ring[next++ & mask] = (uint64_t)pc << 32 | (uint64_t)a << 16 | d;
+        return false;
+    }
+    ALWAYS_INLINE void write(uint32_t address, uint16_t value)
+    {
+        ring[next++ & mask] = TRACE_WRITE | (uint64_t)address << 16 | value;
+    }
+    void halt(uint32_t /*pc*/)
+    {
+        next--; // the halt loop's step is not a cycle
+    }
+
+    // the recorded steps, oldest first, one line each: the cycle, the pc,
+    // A and D before the instruction ran, the RAM word it wrote, and the
+    // label and source line of the pc when debug information has them.
+    // cycles is the number run when the last step was recorded.
+    string dump(const DebugInfo &debug, uint64_t cycles) const
+    {
+        map<int, const string *> labels;
+        for (const pair<string, int> &label : debug.labels)
+            labels.insert(make_pair(label.second, &label.first));
+        string name = filesystem::path(debug.source).filename().string();
+
+        uint64_t first = next > ring.size() ? next - ring.size() : 0;
+        while (first < next && (ring[first & mask] & TRACE_WRITE))
+            first++; // its step was overwritten
+        uint64_t steps = 0;
+        for (uint64_t i = first; i < next; i++)
+            steps += !(ring[i & mask] & TRACE_WRITE);
+
+        string out;
+        char line[96];
+        uint64_t cycle = cycles - steps;
+        for (uint64_t i = first; i < next; i++)
+        {
+            uint64_t word = ring[i & mask];
+            uint32_t pc = (uint32_t)(word >> 32);
+            snprintf(line, sizeof(line), "%12llu %5u  A=%-5u D=%-5u", (unsigned long long)cycle++, pc,
+                     (unsigned)(uint16_t)(word >> 16), (unsigned)(uint16_t)word);
+            out += line;
+            if (i + 1 < next && (ring[(i + 1) & mask] & TRACE_WRITE))
+            {
+                word = ring[++i & mask];
+                snprintf(line, sizeof(line), "  RAM[%u]=%u", (unsigned)(uint16_t)(word >> 16), (unsigned)(uint16_t)word);
+                out += line;
+            }
+            auto label = labels.upper_bound(pc);
+            if (label != labels.begin())
+                out += "  " + *prev(label)->second;
+            if (pc < debug.lines.size())
+                out += " " + name + ":" + to_string(debug.lines[pc]);
+            out += "\n";
+        }
+        return out;
+    }
+
+private:
+    vector<uint64_t> ring;
+    uint64_t mask;
+    uint64_t next; // words written since the start
+};
+
+#define STATE_PAGE 512          // RAM words per page a snapshot tracks
+#define STATE_MAGIC 0x41545348u // "HSTA"
+#define STATE_VERSION 1
+
+uint64_t hashBytes(const char *p, size_t n, uint64_t seed);
+
+// the whole machine at one moment, to go back to it later: many tests can
+// start from one warmed-up state instead of each running the boot again
+struct MachineState
+{
+    uint16_t a = 0;
+    uint16_t d = 0;
+    uint16_t pc = 0;
+    bool halted = false;
+    uint64_t cycles = 0;
+    uint64_t program = 0; // hash of the ROM it was taken with
+    uint64_t id = 0;      // different for every snapshot taken or read
+    vector<uint16_t> ram;
+};
+
+static uint64_t newStateId()
+{
+    static atomic<uint64_t> last(0);
+    return ++last;
+}
+
+class Emulator
+{
+public:
+    uint16_t a;
+    uint16_t d;
+    uint16_t pc;
+    uint64_t cycles; // instructions executed since reset
+    bool halted;     // stopped in a halt loop
+    vector<uint16_t> ram;
+    uint64_t dirty; // a bit per STATE_PAGE words of RAM written since the last save or restore
+
+    Emulator() : ram(RAM_SIZE), program(ROM_SIZE)
+    {
+        load(vector<uint16_t>());
+    }
+
+    // loads rom (words past its end are 0) and resets the machine
+    void load(const vector<uint16_t> &rom)
+    {
+        const MicroOp *decoded = decodeTable();
+        for (size_t i = 0; i < ROM_SIZE; i++)
+            program[i] = decoded[i < rom.size() ? rom[i] : 0];
+        programHash = hashBytes((const char *)rom.data(), rom.size() * sizeof(uint16_t), 0);
+        // "@p-1" at p-1 and "0;JMP" at p only jump to each other, the
+        // usual way a Hack program ends
+        for (size_t p = 1; p < ROM_SIZE; p++)
+        {
+            if (program[p].handler == OP_ZERO && program[p].dest == 0 && program[p].jump == 7 &&
+                program[p - 1].handler == OP_LOAD && program[p - 1].value == p - 1)
+                program[p].handler = OP_HALT;
+        }
+        reset();
+    }
+
+    void reset()
+    {
+        a = d = pc = 0;
+        cycles = 0;
+        halted = false;
+        fill(ram.begin(), ram.end(), 0);
+        dirty = ~0ull;
+    }
+
+    // writes a RAM word from outside a run, marking its page
+    void poke(uint32_t address, uint16_t value)
+    {
+        address &= 0x7FFF;
+        ram[address] = value;
+        dirty |= 1ull << (address / STATE_PAGE);
+    }
+
+    void save(MachineState &state)
+    {
+        state.a = a;
+        state.d = d;
+        state.pc = pc;
+        state.halted = halted;
+        state.cycles = cycles;
+        state.program = programHash;
+        state.id = newStateId();
+        state.ram = ram;
+        baseId = state.id;
+        dirty = 0;
+    }
+
+    // puts the machine back as state has it, false if state was taken
+    // with another program. Going back to the state last saved or restored
+    // copies only the pages written since.
+    bool restore(const MachineState &state)
+    {
+        if (state.program != programHash || state.ram.size() != RAM_SIZE)
+            return false;
+        uint64_t pages = state.id == baseId ? dirty : ~0ull;
+        for (size_t page = 0; page < RAM_SIZE / STATE_PAGE; page++)
+        {
+            if (pages >> page & 1)
+                memcpy(ram.data() + page * STATE_PAGE, state.ram.data() + page * STATE_PAGE, STATE_PAGE * sizeof(uint16_t));
+        }
+        a = state.a;
+        d = state.d;
+        pc = state.pc;
+        halted = state.halted;
+        cycles = state.cycles;
+        baseId = state.id;
+        dirty = 0;
+        return true;
+    }
+
+    // runs until the program halts or maxCycles instructions have run,
+    // returns the number run
+    uint64_t run(uint64_t maxCycles)
+    {
+        NoProbe probe;
+        return run(maxCycles, probe);
+    }
+
+    // the same, showing probe every instruction before it runs, and
+    // stopping early when the probe asks to
+    template <class Probe> uint64_t run(uint64_t maxCycles, Probe &probe)
+    {
+        if (halted)
+            return 0;
+        const MicroOp *code = program.data();
+        uint16_t *m = ram.data();
+        uint32_t ra = a, rd = d, rpc = pc; // kept in registers while running
+        uint64_t written = 0;              // pages, for dirty
+        uint64_t left = maxCycles;
+        MicroOp op;
+
+#if defined(__GNUC__)
+        // threaded dispatch: every handler ends in its own indirect jump
+        static const void *const labels[OP_COUNT] = {
+            &&L_OP_LOAD, &&L_OP_ZERO, &&L_OP_ONE, &&L_OP_MINUS_ONE, &&L_OP_D, &&L_OP_A, &&L_OP_M, &&L_OP_NOT_D,
+            &&L_OP_NOT_A, &&L_OP_NOT_M, &&L_OP_NEG_D, &&L_OP_NEG_A, &&L_OP_NEG_M, &&L_OP_D_PLUS_ONE, &&L_OP_A_PLUS_ONE,
+            &&L_OP_M_PLUS_ONE, &&L_OP_D_MINUS_ONE, &&L_OP_A_MINUS_ONE, &&L_OP_M_MINUS_ONE, &&L_OP_D_PLUS_A,
+            &&L_OP_D_PLUS_M, &&L_OP_D_MINUS_A, &&L_OP_D_MINUS_M, &&L_OP_A_MINUS_D, &&L_OP_M_MINUS_D, &&L_OP_D_AND_A,
+            &&L_OP_D_AND_M, &&L_OP_D_OR_A, &&L_OP_D_OR_M, &&L_OP_ALU, &&L_OP_HALT};
+#define HANDLER(name) L_##name:
+#define NEXT                       \
+    if (left == 0)                 \
+        goto done;                 \
+    if (probe.step(rpc, ra, rd))   \
+        goto done;                 \
+    left--;                        \
+    op = code[rpc];                \
+    goto *labels[op.handler]
+        NEXT;
+#else
+#define HANDLER(name) case name:
+#define NEXT continue
+        for (;;)
+        {
+            if (left == 0)
+                goto done;
+            if (probe.step(rpc, ra, rd))
+                goto done;
+            left--;
+            op = code[rpc];
+            switch (op.handler)
+            {
+#endif
+
+// writes the result to dest and jumps to the old A if the result's sign
+// is in the jump mask. Instructions that cannot jump take a branch so the
+// next pc does not wait for the result.
+#define STORE(expr)                                                                   \
+    {                                                                                 \
+        uint16_t r = (uint16_t)(expr);                                                \
+        uint32_t target = ra & 0x7FFF;                                                \
+        if (op.dest & 1)                                                              \
+        {                                                                             \
+            m[target] = r;                                                            \
+            written |= 1ull << (target / STATE_PAGE);                                 \
+            probe.write(target, r);                                                   \
+        }                                                                             \
+        rd = (op.dest & 2) ? r : rd;                                                  \
+        ra = (op.dest & 4) ? r : ra;                                                  \
+        if (op.jump == 0)                                                             \
+            rpc = (rpc + 1) & 0x7FFF;                                                 \
+        else                                                                          \
+            rpc = ((op.jump >> (((r >> 15) << 1) | (r == 0))) & 1) ? target : (rpc + 1) & 0x7FFF; \
+    }                                                                                 \
+    NEXT;
+#define MEMORY m[ra & 0x7FFF]
+
+        HANDLER(OP_LOAD)
+        ra = op.value;
+        rpc = (rpc + 1) & 0x7FFF;
+        NEXT;
+        HANDLER(OP_ZERO) STORE(0)
+        HANDLER(OP_ONE) STORE(1)
+        HANDLER(OP_MINUS_ONE) STORE(0xFFFF)
+        HANDLER(OP_D) STORE(rd)
+        HANDLER(OP_A) STORE(ra)
+        HANDLER(OP_M) STORE(MEMORY)
+        HANDLER(OP_NOT_D) STORE(~rd)
+        HANDLER(OP_NOT_A) STORE(~ra)
+        HANDLER(OP_NOT_M) STORE(~MEMORY)
+        HANDLER(OP_NEG_D) STORE(-rd)
+        HANDLER(OP_NEG_A) STORE(-ra)
+        HANDLER(OP_NEG_M) STORE(-MEMORY)
+        HANDLER(OP_D_PLUS_ONE) STORE(rd + 1)
+        HANDLER(OP_A_PLUS_ONE) STORE(ra + 1)
+        HANDLER(OP_M_PLUS_ONE) STORE(MEMORY + 1)
+        HANDLER(OP_D_MINUS_ONE) STORE(rd - 1)
+        HANDLER(OP_A_MINUS_ONE) STORE(ra - 1)
+        HANDLER(OP_M_MINUS_ONE) STORE(MEMORY - 1)
+        HANDLER(OP_D_PLUS_A) STORE(rd + ra)
+        HANDLER(OP_D_PLUS_M) STORE(rd + MEMORY)
+        HANDLER(OP_D_MINUS_A) STORE(rd - ra)
+        HANDLER(OP_D_MINUS_M) STORE(rd - MEMORY)
+        HANDLER(OP_A_MINUS_D) STORE(ra - rd)
+        HANDLER(OP_M_MINUS_D) STORE(MEMORY - rd)
+        HANDLER(OP_D_AND_A) STORE(rd & ra)
+        HANDLER(OP_D_AND_M) STORE(rd & MEMORY)
+        HANDLER(OP_D_OR_A) STORE(rd | ra)
+        HANDLER(OP_D_OR_M) STORE(rd | MEMORY)
+        HANDLER(OP_ALU) STORE(aluCompute(op.alu, rd, (op.alu & 0x40) ? MEMORY : ra))
+        HANDLER(OP_HALT)
+        if (ra == rpc - 1)
+        {
+            halted = true;
+            left++; // the halt loop itself is not counted
+            probe.halt(rpc);
+            goto done;
+        }
+        rpc = ra & 0x7FFF;
+        NEXT;
+
+#if !defined(__GNUC__)
+            }
+        }
+#endif
+#undef HANDLER
+#undef NEXT
+#undef STORE
+#undef MEMORY
+
+    done:
+        a = ra;
+        d = rd;
+        pc = rpc;
+        dirty |= written;
+        cycles += maxCycles - left;
+        return maxCycles - left;
+    }
+
+    const MicroOp &op(uint32_t address) const
+    {
+        return program[address];
+    }
+
+private:
+    vector<MicroOp> program;
+    uint64_t programHash;
+    uint64_t baseId = 0; // snapshot the dirty pages are relative to
+};
+
+// state file layout: StateHeader, then the pages marked in its mask, in
+// order; the pages left out are all zero
+struct StateHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t program;
+    uint64_t cycles;
+    uint64_t pages; // a bit per STATE_PAGE words of RAM
+    uint16_t a;
+    uint16_t d;
+    uint16_t pc;
+    uint16_t halted;
+};
+
+bool writeState(const string &fileName, const MachineState &state)
+{
+    StateHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = STATE_MAGIC;
+    header.version = STATE_VERSION;
+    header.program = state.program;
+    header.cycles = state.cycles;
+    header.a = state.a;
+    header.d = state.d;
+    header.pc = state.pc;
+    header.halted = state.halted;
+    string pages;
+    for (size_t page = 0; page < RAM_SIZE / STATE_PAGE; page++)
+    {
+        const uint16_t *words = state.ram.data() + page * STATE_PAGE;
+        if (all_of(words, words + STATE_PAGE, [](uint16_t w) { return w == 0; }))
+            continue;
+        header.pages |= 1ull << page;
+        pages.append((const char *)words, STATE_PAGE * sizeof(uint16_t));
+    }
+    return writeFile(fileName, string((const char *)&header, sizeof(header)) + pages);
+}
+
+bool readState(const string &fileName, MachineState &state, string &diagnostics)
+{
+    string contents;
+    if (!readFile(fileName, contents))
+    {
+        diagnostics += fileName + ": error: cannot open file\n";
+        return false;
+    }
+    StateHeader header;
+    bool ok = contents.size() >= sizeof(header);
+    if (ok)
+    {
+        memcpy(&header, contents.data(), sizeof(header));
+        size_t pages = 0;
+        for (uint64_t mask = header.pages; mask; mask &= mask - 1)
+            pages++;
+        ok = header.magic == STATE_MAGIC && header.version == STATE_VERSION &&
+             contents.size() == sizeof(header) + pages * STATE_PAGE * sizeof(uint16_t);
+    }
+    if (!ok)
+    {
+        diagnostics += fileName + ": error: not a valid state file\n";
+        return false;
+    }
+    state.a = header.a;
+    state.d = header.d;
+    state.pc = header.pc & 0x7FFF;
+    state.halted = header.halted != 0;
+    state.cycles = header.cycles;
+    state.program = header.program;
+    state.id = newStateId();
+    state.ram.assign(RAM_SIZE, 0);
+    const char *p = contents.data() + sizeof(header);
+    for (size_t page = 0; page < RAM_SIZE / STATE_PAGE; page++)
+    {
+        if (!(header.pages >> page & 1))
+            continue;
+        memcpy(state.ram.data() + page * STATE_PAGE, p, STATE_PAGE * sizeof(uint16_t));
+        p += STATE_PAGE * sizeof(uint16_t);
+    }
+    return true;
+}
+
+#ifdef HAVE_X86_64_JIT
+
+#define JIT_CODE_SIZE (16 << 20)
+#define JIT_BLOCK_LIMIT 128  // instructions per translated block
+#define JIT_BLOCK_BYTES 8192 // room a block may need, more than the limit can use
+
+// what translated code keeps in memory; the offsets are baked into the
+// entry and exit code
+struct JitState
+{
+    uint16_t *ram;             // 0
+    const void *const *table;  // 8
+    uint64_t left;             // 16
+    uint32_t a;                // 24
+    uint32_t d;                // 28
+};
+
+// translates the emulator's program into x86-64 one basic block at a
+// time, the first time each block is entered. While translated code runs
+// A is in r12d, D in r13d, the RAM base in rbx, the cycles left in r14
+// and the address-to-block table in r15. Every jump, whether to a label
+// loaded just before it or to a computed A, goes through the table;
+// addresses not yet translated point at the exit, which returns to run()
+// with the pc in eax. Halt loops and the last cycles of a budget run on
+// the interpreter, so results and cycle counts match it exactly.
+class Jit
+{
+public:
+    Jit(Emulator &machine) : emulator(machine), table(ROM_SIZE)
+    {
+        void *p = mmap(nullptr, JIT_CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        code = p == MAP_FAILED ? nullptr : (uint8_t *)p;
+        if (code)
+            flush();
+    }
+    ~Jit()
+    {
+        if (code)
+            munmap(code, JIT_CODE_SIZE);
+    }
+
+    // false if the system gave no executable memory, run() then interprets
+    bool available()
+    {
+        return code != nullptr;
+    }
+
+    // the same contract as Emulator::run
+    uint64_t run(uint64_t maxCycles)
+    {
+        if (!code || emulator.halted)
+            return emulator.run(maxCycles);
+        JitState state = {emulator.ram.data(), table.data(), maxCycles, emulator.a, emulator.d};
+        uint32_t pc = emulator.pc;
+        uint64_t interpreted = 0;
+        while (state.left > 0 && !emulator.halted)
+        {
+            if (table[pc] == exitCode && (emulator.op(pc).handler == OP_HALT || !translate(pc)))
+            {
+                interpret(state, pc, 1, interpreted);
+                continue;
+            }
+            pc = ((uint32_t(*)(JitState *, const void *))enterCode)(&state, table[pc]);
+            // back at a translated block means its cycles did not fit
+            if (state.left > 0 && table[pc] != exitCode)
+                interpret(state, pc, state.left, interpreted);
+        }
+        emulator.a = (uint16_t)state.a;
+        emulator.d = (uint16_t)state.d;
+        emulator.pc = (uint16_t)pc;
+        emulator.cycles += maxCycles - state.left - interpreted;
+        emulator.dirty = ~0ull; // translated code does not track the pages it writes
+        return maxCycles - state.left;
+    }
+
+private:
+    Emulator &emulator;
+    vector<const void *> table;
+    uint8_t *code;
+    uint8_t *cursor;
+    const void *enterCode;
+    const void *exitCode;
+
+    void interpret(JitState &state, uint32_t &pc, uint64_t cycles, uint64_t &interpreted)
+    {
+        emulator.a = (uint16_t)state.a;
+        emulator.d = (uint16_t)state.d;
+        emulator.pc = (uint16_t)pc;
+        uint64_t executed = emulator.run(cycles);
+        interpreted += executed;
+        state.left -= executed;
+        state.a = emulator.a;
+        state.d = emulator.d;
+        pc = emulator.pc;
+    }
+
+    void emit(initializer_list<uint8_t> bytes)
+    {
+        for (uint8_t b : bytes)
+            *cursor++ = b;
+    }
+    void emit32(uint32_t v)
+    {
+        memcpy(cursor, &v, 4);
+        cursor += 4;
+    }
+    void emitRel32(const void *target)
+    {
+        emit32((uint32_t)((const uint8_t *)target - (cursor + 4)));
+    }
+
+    // drops every translation and writes the entry and exit code again
+    void flush()
+    {
+        cursor = code;
+        enterCode = cursor;
+        // push rbx, rbp, r12-r15; rbp = state; load the registers; jmp rsi
+        emit({0x53, 0x55, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57, 0x48, 0x89, 0xFD});
+        emit({0x48, 0x8B, 0x5D, 0x00, 0x4C, 0x8B, 0x7D, 0x08, 0x4C, 0x8B, 0x75, 0x10});
+        emit({0x44, 0x8B, 0x65, 0x18, 0x44, 0x8B, 0x6D, 0x1C, 0xFF, 0xE6});
+        exitCode = cursor;
+        // store left, A and D; pop the registers; return the pc in eax
+        emit({0x4C, 0x89, 0x75, 0x10, 0x44, 0x89, 0x65, 0x18, 0x44, 0x89, 0x6D, 0x1C});
+        emit({0x41, 0x5F, 0x41, 0x5E, 0x41, 0x5D, 0x41, 0x5C, 0x5D, 0x5B, 0xC3});
+        fill(table.begin(), table.end(), exitCode);
+    }
+
+    // mov eax, target; jmp [r15 + target * 8]
+    void emitJump(uint32_t target)
+    {
+        emit({0xB8});
+        emit32(target);
+        emit({0x41, 0xFF, 0xA7});
+        emit32(target * 8);
+    }
+
+    // translates the block starting at start, false if it cannot be
+    bool translate(uint32_t start)
+    {
+        if (cursor + JIT_BLOCK_BYTES > code + JIT_CODE_SIZE)
+            flush();
+        uint8_t *block = cursor;
+        // count the block's instructions first, the entry check needs them
+        uint32_t length = 0;
+        bool jumps = false;
+        for (uint32_t pc = start; length < JIT_BLOCK_LIMIT && !jumps; pc = (pc + 1) & 0x7FFF)
+        {
+            const MicroOp &op = emulator.op(pc);
+            if (op.handler == OP_HALT)
+                break;
+            length++;
+            jumps = op.handler != OP_LOAD && op.jump != 0;
+        }
+        if (length == 0)
+            return false;
+        // cmp r14, length; jb out; sub r14, length
+        emit({0x49, 0x81, 0xFE});
+        emit32(length);
+        emit({0x0F, 0x82});
+        uint8_t *out = cursor;
+        emit32(0);
+        emit({0x49, 0x81, 0xEE});
+        emit32(length);
+
+        int known = -1; // A when it was loaded by a constant in this block
+        uint32_t pc = start;
+        for (uint32_t i = 0; i < length; i++, pc = (pc + 1) & 0x7FFF)
+        {
+            const MicroOp &op = emulator.op(pc);
+            if (op.handler == OP_LOAD)
+            {
+                emit({0x41, 0xBC}); // mov r12d, value
+                emit32(op.value);
+                known = op.value;
+                continue;
+            }
+            int target = known; // jumps go to A as it was before the instruction
+            translateInstruction(op, known);
+            if (op.dest & 4)
+                known = -1;
+            if (op.jump == 0)
+                continue;
+            // the jump ends the block; its target is the old A, in edx unless known
+            if (op.jump == 7)
+            {
+                if (target >= 0)
+                    emitJump(target & 0x7FFF);
+                else
+                    emit({0x89, 0xD0, 0x41, 0xFF, 0x24, 0xD7}); // mov eax, edx; jmp [r15 + rdx * 8]
+                break;
+            }
+            static const uint8_t conditions[8] = {0, 0x8F, 0x84, 0x8D, 0x8C, 0x85, 0x8E, 0};
+            emit({0x66, 0x85, 0xC0, 0x0F, conditions[op.jump]}); // test ax, ax; jcc taken
+            uint8_t *taken = cursor;
+            emit32(0);
+            emitJump((pc + 1) & 0x7FFF);
+            uint32_t offset = (uint32_t)(cursor - (taken + 4));
+            memcpy(taken, &offset, 4);
+            if (target >= 0)
+                emitJump(target & 0x7FFF);
+            else
+                emit({0x89, 0xD0, 0x41, 0xFF, 0x24, 0xD7});
+            break;
+        }
+        if (!jumps)
+            emitJump(pc);
+        // out: mov eax, start; jmp exit
+        uint32_t offset = (uint32_t)(cursor - (out + 4));
+        memcpy(out, &offset, 4);
+        emit({0xB8});
+        emit32(start);
+        emit({0xE9});
+        emitRel32(exitCode);
+        table[start] = block;
+        return true;
+    }
+
+    // leaves the result in eax, zero extended from 16 bits
+    void translateInstruction(const MicroOp &op, int known)
+    {
+        bool memory = (op.alu & 0x40) != 0;
+        // edx = A & 0x7FFF when M or a computed jump target needs it
+        if (known < 0 && ((memory && usesY(op.handler)) || (op.dest & 1) || op.jump))
+            emit({0x44, 0x89, 0xE2, 0x81, 0xE2, 0xFF, 0x7F, 0x00, 0x00});
+        // ecx = y
+        if (usesY(op.handler))
+        {
+            if (!memory)
+                emit({0x44, 0x89, 0xE1}); // mov ecx, r12d
+            else if (known >= 0)
+            {
+                emit({0x0F, 0xB7, 0x8B}); // movzx ecx, word [rbx + disp32]
+                emit32((known & 0x7FFF) * 2);
+            }
+            else
+                emit({0x0F, 0xB7, 0x0C, 0x53}); // movzx ecx, word [rbx + rdx * 2]
+        }
+        switch (op.handler)
+        {
+        case OP_ZERO:
+            emit({0x31, 0xC0});
+            break;
+        case OP_ONE:
+            emit({0xB8, 0x01, 0x00, 0x00, 0x00});
+            break;
+        case OP_MINUS_ONE:
+            emit({0xB8, 0xFF, 0xFF, 0x00, 0x00});
+            break;
+        case OP_D:
+            emit({0x44, 0x89, 0xE8});
+            break;
+        case OP_A:
+        case OP_M:
+            emit({0x89, 0xC8});
+            break;
+        case OP_NOT_D:
+            emit({0x44, 0x89, 0xE8, 0xF7, 0xD0});
+            break;
+        case OP_NOT_A:
+        case OP_NOT_M:
+            emit({0x89, 0xC8, 0xF7, 0xD0});
+            break;
+        case OP_NEG_D:
+            emit({0x44, 0x89, 0xE8, 0xF7, 0xD8});
+            break;
+        case OP_NEG_A:
+        case OP_NEG_M:
+            emit({0x89, 0xC8, 0xF7, 0xD8});
+            break;
+        case OP_D_PLUS_ONE:
+            emit({0x41, 0x8D, 0x45, 0x01});
+            break;
+        case OP_A_PLUS_ONE:
+        case OP_M_PLUS_ONE:
+            emit({0x8D, 0x41, 0x01});
+            break;
+        case OP_D_MINUS_ONE:
+            emit({0x41, 0x8D, 0x45, 0xFF});
+            break;
+        case OP_A_MINUS_ONE:
+        case OP_M_MINUS_ONE:
+            emit({0x8D, 0x41, 0xFF});
+            break;
+        case OP_D_PLUS_A:
+        case OP_D_PLUS_M:
+            emit({0x41, 0x8D, 0x44, 0x0D, 0x00}); // lea eax, [r13 + rcx]
+            break;
+        case OP_D_MINUS_A:
+        case OP_D_MINUS_M:
+            emit({0x44, 0x89, 0xE8, 0x29, 0xC8});
+            break;
+        case OP_A_MINUS_D:
+        case OP_M_MINUS_D:
+            emit({0x89, 0xC8, 0x44, 0x29, 0xE8});
+            break;
+        case OP_D_AND_A:
+        case OP_D_AND_M:
+            emit({0x44, 0x89, 0xE8, 0x21, 0xC8});
+            break;
+        case OP_D_OR_A:
+        case OP_D_OR_M:
+            emit({0x44, 0x89, 0xE8, 0x09, 0xC8});
+            break;
+        default:
+            // any other control bits, step by step like the ALU
+            emit({0x44, 0x89, 0xE8});
+            if (op.alu & 32)
+                emit({0x31, 0xC0});
+            if (op.alu & 16)
+                emit({0xF7, 0xD0});
+            if (op.alu & 8)
+                emit({0x31, 0xC9});
+            if (op.alu & 4)
+                emit({0xF7, 0xD1});
+            emit({(uint8_t)((op.alu & 2) ? 0x01 : 0x21), 0xC8});
+            if (op.alu & 1)
+                emit({0xF7, 0xD0});
+            break;
+        }
+        emit({0x0F, 0xB7, 0xC0}); // movzx eax, ax
+        if (op.dest & 1)
+        {
+            if (known >= 0)
+            {
+                emit({0x66, 0x89, 0x83}); // mov [rbx + disp32], ax
+                emit32((known & 0x7FFF) * 2);
+            }
+            else
+                emit({0x66, 0x89, 0x04, 0x53}); // mov [rbx + rdx * 2], ax
+        }
+        if (op.dest & 2)
+            emit({0x41, 0x89, 0xC5}); // mov r13d, eax
+        if (op.dest & 4)
+            emit({0x41, 0x89, 0xC4}); // mov r12d, eax
+    }
+
+    // whether a computation reads y (A or M)
+    static bool usesY(uint8_t handler)
+    {
+        switch (handler)
+        {
+        case OP_ZERO:
+        case OP_ONE:
+        case OP_MINUS_ONE:
+        case OP_D:
+        case OP_NOT_D:
+        case OP_NEG_D:
+        case OP_D_PLUS_ONE:
+        case OP_D_MINUS_ONE:
+            return false;
+        default:
+            return true;
+        }
+    }
+};
+
+#endif
+
+// reads a .hack file, or assembles any other file, into rom
+bool loadProgram(const string &fileName, const Options &options, vector<uint16_t> &rom, string &diagnostics,
+                 DebugInfo *debug = nullptr)
+{
+    string source;
+    if (!readFile(fileName, source))
+    {
+        diagnostics += fileName + ": error: cannot open file\n";
+        return false;
+    }
+    if (filesystem::path(fileName).extension() != ".hack")
+        return assemble(source, fileName, options, rom, diagnostics, debug);
+    rom.clear();
+    size_t begin = 0;
+    uint32_t number = 0;
+    while (begin < source.size())
+    {
+        size_t end = source.find('\n', begin);
+        if (end == string::npos)
+            end = source.size();
+        string_view line(source.data() + begin, end - begin);
+        begin = end + 1;
+        number++;
+        if (!line.empty() && line.back() == '\r')
+            line.remove_suffix(1);
+        if (line.empty())
+            continue;
+        uint16_t word = 0;
+        bool ok = line.size() == 16;
+        for (size_t i = 0; ok && i < 16; i++)
+        {
+            ok = line[i] == '0' || line[i] == '1';
+            word = (uint16_t)(word << 1 | (line[i] - '0'));
+        }
+        if (!ok || rom.size() == ROM_SIZE)
+        {
+            diagnostics += fileName + ":" + to_string(number) + ": error: " +
+                           (ok ? "program does not fit in ROM" : "not a 16-bit binary word") + "\n";
+            return false;
+        }
+        rom.push_back(word);
+    }
+    return true;
+}
+
+// writes a flat profile of the cycles by enclosing label, the last label
+// defined at or before each address, and the same cycles as collapsed
+// stacks (routine;label;file:line count) for flame graph tools. The
+// routine is the label up to a '$', the VM translator's marker for labels
+// inside a function. Without debug information addresses stand in for
+// labels and lines.
+void writeProfile(const CycleProfile &profile, const DebugInfo &debug, const string &name, string &flat, string &stacks)
+{
+    // labels by address, the first one defined wins a shared address
+    vector<pair<int, string>> labels;
+    for (const pair<string, int> &label : debug.labels)
+        labels.push_back(make_pair(label.second, label.first));
+    stable_sort(labels.begin(), labels.end(),
+                [](const pair<int, string> &x, const pair<int, string> &y) { return x.first < y.first; });
+    labels.erase(unique(labels.begin(), labels.end(),
+                        [](const pair<int, string> &x, const pair<int, string> &y) { return x.first == y.first; }),
+                 labels.end());
+
+    uint64_t total = 0;
+    unordered_map<string, uint64_t> byLabel;
+    map<string, uint64_t> byStack;
+    size_t next = 0; // first label past the address
+    string label = "(start)";
+    for (uint32_t address = 0; address < ROM_SIZE; address++)
+    {
+        while (next < labels.size() && labels[next].first <= (int)address)
+            label = labels[next++].second;
+        uint64_t count = profile.counts[address];
+        if (count == 0)
+            continue;
+        total += count;
+        string line = address < debug.lines.size() ? name + ":" + to_string(debug.lines[address])
+                                                    : "@" + to_string(address);
+        string where = debug.lines.empty() ? "@" + to_string(address) : label;
+        byLabel[where] += count;
+        string routine = where.substr(0, where.find('$'));
+        byStack[debug.lines.empty() ? where : (routine != where ? routine + ";" : "") + where + ";" + line] += count;
+    }
+
+    vector<pair<uint64_t, string>> ranked;
+    for (auto &entry : byLabel)
+        ranked.push_back(make_pair(entry.second, entry.first));
+    sort(ranked.begin(), ranked.end(),
+         [](const pair<uint64_t, string> &x, const pair<uint64_t, string> &y)
+         { return x.first != y.first ? x.first > y.first : x.second < y.second; });
+    char row[64];
+    flat = "        cycles    self   total  label\n";
+    uint64_t cumulative = 0;
+    for (auto &entry : ranked)
+    {
+        cumulative += entry.first;
+        snprintf(row, sizeof(row), "%14llu %6.2f%% %6.2f%%  ", (unsigned long long)entry.first,
+                 100.0 * entry.first / total, 100.0 * cumulative / total);
+        flat += row + entry.second + "\n";
+    }
+    stacks.clear();
+    for (auto &entry : byStack)
+        stacks += entry.first + " " + to_string(entry.second) + "\n";
+}
+
+// static cost of one routine: a label without '$' and the code up to
+// the next such label
+struct RoutineCost
+{
+    string name;
+    uint32_t address;
+    uint32_t instructions;
+    uint32_t loops; // loop headers
+    uint32_t depth; // deepest loop nesting
+    uint64_t best;  // cycles of the shortest acyclic path from entry to exit
+    uint64_t worst; // and of the longest
+};
+
+// builds each routine's control-flow graph from the decoded program:
+// blocks end at jumps, a jump goes to the label loaded just before it
+// (other targets, like returns, leave the routine) and a conditional
+// jump also falls through. Back edges found from the entry mark loops;
+// without them the graph is acyclic and gives the path bounds.
+vector<RoutineCost> analyzeProgram(const vector<uint16_t> &rom, const DebugInfo &debug)
+{
+    Emulator emulator;
+    emulator.load(rom);
+    uint32_t size = (uint32_t)min(rom.size(), (size_t)ROM_SIZE);
+
+    // jump targets: the constant A holds, as far as a linear scan can tell
+    vector<bool> labelled(size + 1, false);
+    for (const pair<string, int> &label : debug.labels)
+        labelled[min((uint32_t)label.second, size)] = true;
+    vector<int> target(size, -1);
+    int known = -1;
+    for (uint32_t p = 0; p < size; p++)
+    {
+        const MicroOp &op = emulator.op(p);
+        if (labelled[p])
+            known = -1; // reached from elsewhere, A may differ
+        if (op.handler == OP_LOAD)
+            known = op.value & 0x7FFF;
+        else
+        {
+            if (op.handler != OP_HALT && op.jump)
+                target[p] = known;
+            if (op.dest & 4)
+                known = -1;
+        }
+    }
+
+    // routine boundaries
+    vector<pair<uint32_t, string>> starts;
+    for (const pair<string, int> &label : debug.labels)
+    {
+        if (label.first.find('$') == string::npos && (uint32_t)label.second < size)
+            starts.push_back(make_pair((uint32_t)label.second, label.first));
+    }
+    stable_sort(starts.begin(), starts.end(),
+                [](const pair<uint32_t, string> &x, const pair<uint32_t, string> &y) { return x.first < y.first; });
+    starts.erase(unique(starts.begin(), starts.end(),
+                        [](const pair<uint32_t, string> &x, const pair<uint32_t, string> &y) { return x.first == y.first; }),
+                 starts.end());
+    if (starts.empty() || starts[0].first > 0)
+        starts.insert(starts.begin(), make_pair(0u, string("(start)")));
+
+    vector<RoutineCost> costs;
+    for (size_t r = 0; r < starts.size(); r++)
+    {
+        uint32_t lo = starts[r].first;
+        uint32_t hi = r + 1 < starts.size() ? starts[r + 1].first : size;
+        if (lo >= hi)
+            continue;
+        auto jumps = [&](uint32_t p) { return emulator.op(p).handler == OP_HALT || (emulator.op(p).handler != OP_LOAD && emulator.op(p).jump); };
+
+        // blocks start at the entry, after jumps and at jump targets inside the routine
+        vector<bool> leader(hi - lo + 1, false);
+        leader[0] = true;
+        for (uint32_t p = lo; p < hi; p++)
+        {
+            if (!jumps(p))
+                continue;
+            leader[p + 1 - lo] = true;
+            if (target[p] >= (int)lo && target[p] < (int)hi)
+                leader[target[p] - lo] = true;
+        }
+        vector<uint32_t> begins;
+        vector<int> blockAt(hi - lo, -1);
+        for (uint32_t p = lo; p < hi; p++)
+        {
+            if (leader[p - lo])
+                begins.push_back(p);
+            blockAt[p - lo] = (int)begins.size() - 1;
+        }
+        size_t n = begins.size();
+        vector<uint32_t> lengths(n);
+        vector<vector<int>> successors(n);
+        vector<bool> exits(n, false);
+        for (size_t b = 0; b < n; b++)
+        {
+            uint32_t end = b + 1 < n ? begins[b + 1] : hi;
+            lengths[b] = end - begins[b];
+            uint32_t last = end - 1;
+            const MicroOp &op = emulator.op(last);
+            if (op.handler == OP_HALT)
+            {
+                exits[b] = true;
+                continue;
+            }
+            bool isJump = op.handler != OP_LOAD && op.jump;
+            if (!isJump || op.jump != 7)
+            {
+                if (end < hi)
+                    successors[b].push_back(blockAt[end - lo]);
+                else
+                    exits[b] = true;
+            }
+            if (isJump)
+            {
+                if (target[last] >= (int)lo && target[last] < (int)hi)
+                    successors[b].push_back(blockAt[target[last] - lo]);
+                else
+                    exits[b] = true;
+            }
+        }
+
+        // depth-first from the entry: back edges, and a postorder of the rest
+        vector<int> state(n, 0); // 0 unseen, 1 on the stack, 2 done
+        vector<pair<int, int>> backEdges;
+        vector<int> postorder;
+        vector<pair<int, size_t>> stack;
+        stack.push_back(make_pair(0, 0));
+        state[0] = 1;
+        while (!stack.empty())
+        {
+            int b = stack.back().first;
+            size_t &i = stack.back().second;
+            if (i < successors[b].size())
+            {
+                int s = successors[b][i++];
+                if (state[s] == 1)
+                    backEdges.push_back(make_pair(b, s));
+                else if (state[s] == 0)
+                {
+                    state[s] = 1;
+                    stack.push_back(make_pair(s, 0));
+                }
+                continue;
+            }
+            state[b] = 2;
+            postorder.push_back(b);
+            stack.pop_back();
+        }
+
+        // natural loops: the blocks that reach a back edge's source without its header
+        vector<vector<int>> predecessors(n);
+        for (size_t b = 0; b < n; b++)
+        {
+            for (int s : successors[b])
+                predecessors[s].push_back((int)b);
+        }
+        vector<int> headers;
+        vector<vector<bool>> bodies;
+        for (const pair<int, int> &edge : backEdges)
+        {
+            size_t h = find(headers.begin(), headers.end(), edge.second) - headers.begin();
+            if (h == headers.size())
+            {
+                headers.push_back(edge.second);
+                bodies.push_back(vector<bool>(n, false));
+                bodies.back()[edge.second] = true;
+            }
+            vector<bool> &body = bodies[h];
+            vector<int> work;
+            if (!body[edge.first])
+            {
+                body[edge.first] = true;
+                work.push_back(edge.first);
+            }
+            while (!work.empty())
+            {
+                int b = work.back();
+                work.pop_back();
+                for (int p : predecessors[b])
+                {
+                    if (!body[p] && state[p] == 2)
+                    {
+                        body[p] = true;
+                        work.push_back(p);
+                    }
+                }
+            }
+        }
+        uint32_t depth = 0;
+        for (size_t b = 0; b < n; b++)
+        {
+            uint32_t d = 0;
+            for (const vector<bool> &body : bodies)
+                d += body[b];
+            depth = max(depth, d);
+        }
+
+        // path bounds over the forward edges, successors first
+        vector<uint64_t> best(n, 0), worst(n, 0);
+        for (int b : postorder)
+        {
+            bool any = exits[b];
+            uint64_t low = UINT64_MAX, high = 0;
+            if (exits[b])
+                low = 0;
+            for (int s : successors[b])
+            {
+                if (find(backEdges.begin(), backEdges.end(), make_pair(b, s)) != backEdges.end())
+                    continue;
+                any = true;
+                low = min(low, best[s]);
+                high = max(high, worst[s]);
+            }
+            if (!any)
+                low = 0; // only back edges leave it: the acyclic path ends here
+            best[b] = lengths[b] + low;
+            worst[b] = lengths[b] + high;
+        }
+        costs.push_back(RoutineCost{starts[r].second, lo, hi - lo, (uint32_t)headers.size(), depth, best[0], worst[0]});
+    }
+    return costs;
+}
+
+// a RAM address given as a number or a predefined symbol, -1 if neither
+int ramAddress(const string &s)
+{
+    int address = predefinedAddress(s);
+    if (address >= 0)
+        return address;
+    char *end;
+    long n = strtol(s.c_str(), &end, 10);
+    return !s.empty() && *end == 0 && n >= 0 && n < RAM_SIZE ? (int)n : -1;
+}
+
+// C expression of a computation, y is "a" or an M access
+static string cExpression(const MicroOp &op, const string &y)
+{
+    switch (op.handler)
+    {
+    case OP_ZERO:
+        return "0";
+    case OP_ONE:
+        return "1";
+    case OP_MINUS_ONE:
+        return "0xFFFF";
+    case OP_D:
+        return "d";
+    case OP_A:
+    case OP_M:
+        return y;
+    case OP_NOT_D:
+        return "~d";
+    case OP_NOT_A:
+    case OP_NOT_M:
+        return "~" + y;
+    case OP_NEG_D:
+        return "-d";
+    case OP_NEG_A:
+    case OP_NEG_M:
+        return "-" + y;
+    case OP_D_PLUS_ONE:
+        return "d + 1";
+    case OP_A_PLUS_ONE:
+    case OP_M_PLUS_ONE:
+        return y + " + 1";
+    case OP_D_MINUS_ONE:
+        return "d - 1";
+    case OP_A_MINUS_ONE:
+    case OP_M_MINUS_ONE:
+        return y + " - 1";
+    case OP_D_PLUS_A:
+    case OP_D_PLUS_M:
+        return "d + " + y;
+    case OP_D_MINUS_A:
+    case OP_D_MINUS_M:
+        return "d - " + y;
+    case OP_A_MINUS_D:
+    case OP_M_MINUS_D:
+        return y + " - d";
+    case OP_D_AND_A:
+    case OP_D_AND_M:
+        return "d & " + y;
+    case OP_D_OR_A:
+    case OP_D_OR_M:
+        return "d | " + y;
+    default:
+    {
+        // any other control bits, step by step like the ALU
+        string x = (op.alu & 32) ? "0" : "d";
+        string z = (op.alu & 8) ? "0" : y;
+        if (op.alu & 16)
+            x = "~" + x;
+        if (op.alu & 4)
+            z = "~" + z;
+        string r = "(" + x + (op.alu & 2 ? " + " : " & ") + z + ")";
+        return (op.alu & 1) ? "~" + r : r;
+    }
+    }
+}
+
+// writes rom as a C function, hack_run(), that behaves exactly like
+// Emulator::run on it: same results, cycle counts and halt. Every
+// address is a case of a switch on the pc, so a run can start or resume
+// anywhere; instructions fall through to the next, and a jump whose
+// target matches the label loaded before it is a goto instead of a trip
+// through the switch.
+string transpileC(const vector<uint16_t> &rom, const string &name)
+{
+    Emulator emulator; // decodes the words and finds the halt loops
+    emulator.load(rom);
+    size_t size = min(rom.size(), (size_t)ROM_SIZE);
+
+    // the label loaded before each jump, which gets a goto label
+    vector<int> predicted(size, -1);
+    vector<bool> labelled(size, false);
+    // r, m and t (the jump target) are only declared if some instruction uses them
+    bool computes = false, memory = false, jumps = false;
+    int known = -1;
+    for (size_t p = 0; p < size; p++)
+    {
+        const MicroOp &op = emulator.op(p);
+        if (op.handler == OP_LOAD)
+        {
+            known = op.value & 0x7FFF;
+            continue;
+        }
+        if (op.handler != OP_HALT)
+        {
+            computes = true;
+            memory |= (op.alu & 0x40) || (op.dest & 1);
+            jumps |= op.jump != 0;
+        }
+        if (op.handler != OP_HALT && op.jump && known >= 0 && (size_t)known < size)
+        {
+            predicted[p] = known;
+            labelled[known] = true;
+        }
+        if (op.handler == OP_HALT || (op.dest & 4) || op.jump == 7)
+            known = -1;
+    }
+
+    static const char *const conditions[8] = {"", "(int16_t)r > 0", "r == 0", "(int16_t)r >= 0",
+                                              "(int16_t)r < 0", "r != 0", "(int16_t)r <= 0", ""};
+    string c;
+    c += "/* " + name + ", translated to C by HackAssembler " ASSEMBLER_VERSION " */\n\n";
+    c += "#include <stdint.h>\n\n";
+    c += "/* marks the cases entered from the instruction before */\n";
+    c += "#if defined(__has_attribute)\n#if __has_attribute(fallthrough)\n"
+         "#define HACK_FALLTHROUGH __attribute__((fallthrough))\n#endif\n#endif\n"
+         "#ifndef HACK_FALLTHROUGH\n#define HACK_FALLTHROUGH\n#endif\n\n";
+    c += "typedef struct\n{\n    uint16_t a, d, pc;\n    uint64_t cycles;\n    int halted;\n    uint16_t ram[32768];\n} hack_state;\n\n";
+    c += "/* runs until the program halts or max_cycles instructions have run,\n   returns the number run */\n";
+    c += "uint64_t hack_run(hack_state *s, uint64_t max_cycles)\n{\n";
+    c += string("    uint16_t a = s->a, d = s->d") + (computes ? ", r" : "") + (memory ? ", *m = s->ram" : "") + ";\n";
+    c += string("    uint32_t pc = s->pc") + (jumps ? ", t" : "") + ";\n";
+    c += "    uint64_t left = max_cycles;\n";
+    c += "    if (s->halted)\n        return 0;\n";
+    c += "    for (;;)\n    {\n        switch (pc)\n        {\n";
+    for (size_t p = 0; p < size; p++)
+    {
+        const MicroOp &op = emulator.op(p);
+        string at = to_string(p);
+        // every instruction but a halt loop and an unconditional jump runs on into the next
+        if (p > 0)
+        {
+            const MicroOp &previous = emulator.op(p - 1);
+            if (previous.handler != OP_HALT && (previous.handler == OP_LOAD || previous.jump != 7))
+                c += "            HACK_FALLTHROUGH;\n";
+        }
+        c += "        case " + at + ":" + (labelled[p] ? " L" + at + ":" : "") + "\n";
+        c += "            if (!left)\n            {\n                pc = " + at + ";\n                goto done;\n            }\n";
+        if (op.handler == OP_HALT)
+        {
+            c += "            if (a == " + to_string(p - 1) + ")\n            {\n                s->halted = 1;\n                pc = " + at +
+                 ";\n                goto done;\n            }\n";
+            c += "            left--;\n            pc = a & 0x7FFF;\n            continue;\n";
+            continue;
+        }
+        c += "            left--;\n";
+        if (op.handler == OP_LOAD)
+        {
+            c += "            a = " + to_string(op.value) + ";\n";
+            continue;
+        }
+        string y = (op.alu & 0x40) ? "m[a & 0x7FFF]" : "a";
+        if (op.jump)
+            c += "            t = a & 0x7FFF;\n";
+        c += "            r = (uint16_t)(" + cExpression(op, y) + ");\n";
+        if (op.dest & 1)
+            c += "            m[" + string(op.jump ? "t" : "a & 0x7FFF") + "] = r;\n";
+        if (op.dest & 2)
+            c += "            d = r;\n";
+        if (op.dest & 4)
+            c += "            a = r;\n";
+        if (!op.jump)
+            continue;
+        string indent = op.jump == 7 ? "            " : "                ";
+        string jump;
+        if (predicted[p] >= 0)
+            jump += indent + "if (t == " + to_string(predicted[p]) + ")\n" + indent + "    goto L" + to_string(predicted[p]) + ";\n";
+        jump += indent + "pc = t;\n" + indent + "continue;\n";
+        if (op.jump == 7)
+            c += jump;
+        else
+            c += "            if (" + string(conditions[op.jump]) + ")\n            {\n" + jump + "            }\n";
+    }
+    // an empty rom has no case before the default to run on from
+    if (size > 0)
+        c += "            pc = " + to_string(size) + ";\n            HACK_FALLTHROUGH;\n";
+    c += "        default:\n";
+    c += "            /* past the program every word is 0, @0 */\n";
+    c += "            for (; pc < 32768; pc++)\n            {\n                if (!left)\n                    goto done;\n"
+         "                left--;\n                a = 0;\n            }\n            pc = 0;\n        }\n    }\n";
+    c += "done:\n    s->a = a;\n    s->d = d;\n    s->pc = (uint16_t)pc;\n    s->cycles += max_cycles - left;\n"
+         "    return max_cycles - left;\n}\n";
+    // a main like --run's, for building the file on its own
+    c += R"(
+#ifdef HACK_MAIN
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* usage: program [CYCLES] [ADDR=VALUE]... [ADDR[-ADDR]]..., addresses in decimal */
+int main(int argc, char **argv)
+{
+    static hack_state s;
+    uint64_t executed, cycles = argc > 1 ? strtoull(argv[1], 0, 10) : 1000000000;
+    int i, from, to;
+    for (i = 2; i < argc; i++)
+    {
+        if (strchr(argv[i], '='))
+            s.ram[atoi(argv[i]) & 0x7FFF] = (uint16_t)atoi(strchr(argv[i], '=') + 1);
+    }
+    executed = hack_run(&s, cycles);
+    for (i = 2; i < argc; i++)
+    {
+        if (strchr(argv[i], '='))
+            continue;
+        from = atoi(argv[i]);
+        to = strchr(argv[i], '-') ? atoi(strchr(argv[i], '-') + 1) : from;
+        for (; from <= to && from < 32768; from++)
+            printf("RAM[%d] = %d\n", from, (int16_t)s.ram[from]);
+    }
+    fprintf(stderr, "%s after %llu cycles\n", s.halted ? "halted" : "stopped", (unsigned long long)executed);
+    return 0;
+}
+#endif
+)";
+    return c;
+}
+
+// the count of a repeat written without one, which runs until the
+// program halts or the cycle limit is reached
+#define REPEAT_FOREVER UINT64_MAX
+// CPU time of the calling thread in seconds
+double cpuSeconds()
+{
+#ifdef __linux__
+    timespec t;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+#else
+    return chrono::duration<double>(chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+// one command of a test script; repeat has a count and a body
+struct TestCommand
+{
+    string name;
+    vector<string> args;
+    uint64_t count;
+    vector<TestCommand> body;
+};
+
+// a column of output-list: RAM[i], A, D, PC or time, with the
+// %Fmt.left.width.right format of the Nand2Tetris tools
+struct TestColumn
+{
+    string name;
+    char format;
+    int left;
+    int width;
+    int right;
+};
+
+// runs a Nand2Tetris CPU emulator script (.tst) on the built-in
+// emulator: load, output-file, compare-to, output-list, set, repeat,
+// ticktock and output, comparing each output line with the .cmp file
+// as it is produced, like the course's tools do
+class TestScript
+{
+public:
+    string fileName;
+    uint64_t cycles = 0;                       // instructions executed
+    const vector<uint16_t> *program = nullptr; // loaded instead of the file a load names
+    bool writeOutput = true;                   // write the output-file
+    uint64_t cycleLimit = UINT64_MAX;
+    double cpuLimit = 0; // seconds of CPU time for the whole script, 0 for none
+    const MachineState *state = nullptr;       // restored after every load
+
+    TestScript(const string &name, const Options &options, uint64_t maxCycles) : options(options)
+    {
+        fileName = name;
+        limit = maxCycles;
+        directory = filesystem::path(name).parent_path();
+    }
+
+    // runs the script; on failure message says where and why
+    bool run(string &message)
+    {
+        string source;
+        if (!readFile(fileName, source))
+        {
+            message = "cannot open file";
+            return false;
+        }
+        vector<string> tokens = tokenize(source);
+        start = cpuSeconds();
+        size_t position = 0;
+        vector<TestCommand> commands;
+        if (!parse(tokens, position, commands, message))
+            return false;
+        bool ok = execute(commands, message);
+        if (writeOutput && !outputFileName.empty())
+            writeFile(outputFileName, output);
+        if (ok && compared < expected.size())
+        {
+            message = "comparison failure at line " + to_string(compared + 1) + ": the script produced no more output";
+            ok = false;
+        }
+        return ok;
+    }
+
+private:
+    Options options;
+    uint64_t limit; // instructions a repeat without a count may run in all
+    filesystem::path directory;
+    Emulator emulator;
+    string outputFileName;
+    string output;
+    vector<string> expected; // lines of the .cmp file
+    size_t compared = 0;
+    bool comparing = false;
+    vector<TestColumn> columns;
+    double start = 0;
+
+    static vector<string> tokenize(const string &source)
+    {
+        vector<string> tokens;
+        size_t i = 0;
+        while (i < source.size())
+        {
+            char c = source[i];
+            if (isspace((unsigned char)c))
+                i++;
+            else if (source.compare(i, 2, "//") == 0)
+                i = source.find('\n', i) == string::npos ? source.size() : source.find('\n', i);
+            else if (source.compare(i, 2, "/*") == 0)
+                i = source.find("*/", i + 2) == string::npos ? source.size() : source.find("*/", i + 2) + 2;
+            else if (strchr(",;!{}", c))
+                tokens.push_back(string(1, source[i++]));
+            else
+            {
+                size_t begin = i;
+                while (i < source.size() && !isspace((unsigned char)source[i]) && !strchr(",;!{}", source[i]))
+                    i++;
+                tokens.push_back(source.substr(begin, i - begin));
+            }
+        }
+        return tokens;
+    }
+
+    // commands up to the end or a closing brace
+    bool parse(const vector<string> &tokens, size_t &position, vector<TestCommand> &commands, string &message)
+    {
+        while (position < tokens.size() && tokens[position] != "}")
+        {
+            TestCommand command;
+            command.name = tokens[position++];
+            command.count = 0;
+            if (strchr(",;!{", command.name[0]))
+                continue; // an empty command
+            if (command.name == "repeat")
+            {
+                if (position + 1 >= tokens.size())
+                {
+                    message = "repeat without a body";
+                    return false;
+                }
+                command.count = REPEAT_FOREVER;
+                if (tokens[position] != "{")
+                    command.count = strtoull(tokens[position++].c_str(), nullptr, 10);
+                if (tokens[position++] != "{" || !parse(tokens, position, command.body, message))
+                {
+                    message = message.empty() ? "expected { after repeat" : message;
+                    return false;
+                }
+                if (position >= tokens.size())
+                {
+                    message = "missing } after repeat";
+                    return false;
+                }
+                position++;
+            }
+            else
+            {
+                while (position < tokens.size() && !strchr(",;!{}", tokens[position][0]))
+                    command.args.push_back(tokens[position++]);
+                if (position < tokens.size() && tokens[position] != "}")
+                    position++;
+            }
+            commands.push_back(command);
+        }
+        return true;
+    }
+
+    bool execute(const vector<TestCommand> &commands, string &message)
+    {
+        for (const TestCommand &command : commands)
+        {
+            if (command.name == "repeat")
+            {
+                // a body of ticktocks alone is one run of the emulator
+                bool ticks = true;
+                for (const TestCommand &inner : command.body)
+                    ticks = ticks && inner.name == "ticktock";
+                if (command.count == REPEAT_FOREVER)
+                {
+                    if (!repeatForever(command, ticks, message))
+                        return false;
+                    continue;
+                }
+                if (ticks)
+                {
+                    if (!tick(command.count * command.body.size(), message))
+                        return false;
+                    continue;
+                }
+                for (uint64_t i = 0; i < command.count; i++)
+                {
+                    if (!execute(command.body, message))
+                        return false;
+                }
+            }
+            else if (command.name == "ticktock" || command.name == "tock")
+            {
+                if (!tick(1, message))
+                    return false;
+            }
+            else if (command.name == "tick" || command.name == "echo" || command.name == "clear-echo")
+                continue;
+            else if (command.name == "load")
+            {
+                vector<uint16_t> rom;
+                string file = command.args.empty() ? filesystem::path(fileName).stem().string() + ".hack" : command.args[0];
+                if (program)
+                    rom = *program;
+                else if (!loadRom(file, rom, message))
+                    return false;
+                emulator.load(rom);
+                if (state && !emulator.restore(*state))
+                {
+                    message = file + ": the saved state is of another program";
+                    return false;
+                }
+            }
+            else if (command.name == "output-file" && command.args.size() == 1)
+                outputFileName = (directory / command.args[0]).string();
+            else if (command.name == "compare-to" && command.args.size() == 1)
+            {
+                string text;
+                if (!readFile((directory / command.args[0]).string(), text))
+                {
+                    message = command.args[0] + ": cannot open file";
+                    return false;
+                }
+                expected.clear();
+                size_t begin = 0;
+                while (begin < text.size())
+                {
+                    size_t end = text.find('\n', begin);
+                    if (end == string::npos)
+                        end = text.size();
+                    string line = text.substr(begin, end - begin);
+                    if (!line.empty() && line.back() == '\r')
+                        line.pop_back();
+                    expected.push_back(line);
+                    begin = end + 1;
+                }
+                comparing = true;
+            }
+            else if (command.name == "output-list")
+            {
+                columns.clear();
+                for (const string &arg : command.args)
+                {
+                    TestColumn column = {arg, 'D', 1, 6, 1};
+                    size_t percent = arg.find('%');
+                    if (percent != string::npos)
+                    {
+                        column.name = arg.substr(0, percent);
+                        if (percent + 1 < arg.size())
+                            column.format = arg[percent + 1];
+                        sscanf(arg.c_str() + percent + 2, "%d.%d.%d", &column.left, &column.width, &column.right);
+                    }
+                    columns.push_back(column);
+                }
+                string header = "|";
+                for (const TestColumn &column : columns)
+                {
+                    int total = column.left + column.width + column.right;
+                    string name = column.name.substr(0, total);
+                    int before = (total - (int)name.size()) / 2;
+                    header += string(before, ' ') + name + string(total - before - name.size(), ' ') + "|";
+                }
+                if (!emit(header, message))
+                    return false;
+            }
+            else if (command.name == "output")
+            {
+                string line = "|";
+                for (const TestColumn &column : columns)
+                {
+                    int value;
+                    if (!variable(column.name, value))
+                    {
+                        message = "unknown variable " + column.name;
+                        return false;
+                    }
+                    line += string(column.left, ' ') + format(column, value) + string(column.right, ' ') + "|";
+                }
+                if (!emit(line, message))
+                    return false;
+            }
+            else if (command.name == "set" && command.args.size() == 2)
+            {
+                if (!set(command.args[0], command.args[1]))
+                {
+                    message = "cannot set " + command.args[0] + " to " + command.args[1];
+                    return false;
+                }
+            }
+            else
+            {
+                message = "unsupported command '" + command.name + "'";
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // runs the body of a repeat without a count until the program halts;
+    // reaching the cycle limit first, or a body that runs no instructions,
+    // fails the script instead of running forever
+    bool repeatForever(const TestCommand &command, bool ticks, string &message)
+    {
+        uint64_t bound = min(limit, cycleLimit);
+        while (!emulator.halted)
+        {
+            if (cycles >= bound)
+            {
+                message = bound == cycleLimit ? "cycle limit of " + to_string(cycleLimit) + " exceeded"
+                                              : "repeat without a count did not halt within " + to_string(limit) + " cycles";
+                return false;
+            }
+            if (ticks && !command.body.empty())
+            {
+                // whole iterations, the last one ticking in place once halted
+                uint64_t n = emulator.run(min(bound - cycles, (uint64_t)1000000));
+                cycles += (n + command.body.size() - 1) / command.body.size() * command.body.size();
+                if (cpuLimit > 0 && cpuSeconds() - start > cpuLimit)
+                {
+                    message = "time limit exceeded";
+                    return false;
+                }
+                continue;
+            }
+            uint64_t before = cycles;
+            if (!execute(command.body, message))
+                return false;
+            if (cycles == before)
+            {
+                message = "repeat without a count runs no instructions";
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // runs n cycles in slices, checking the limits between them
+    bool tick(uint64_t n, string &message)
+    {
+        while (n > 0)
+        {
+            uint64_t slice = min(n, (uint64_t)1000000);
+            if (cycles + slice > cycleLimit)
+            {
+                emulator.run(cycleLimit - cycles);
+                cycles = cycleLimit;
+                message = "cycle limit of " + to_string(cycleLimit) + " exceeded";
+                return false;
+            }
+            emulator.run(slice);
+            cycles += slice; // a halted program keeps ticking in place
+            n -= slice;
+            if (cpuLimit > 0 && cpuSeconds() - start > cpuLimit)
+            {
+                message = "time limit exceeded";
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // the program of a load command, a .hack file or, when there is
+    // none, the .asm of the same name assembled here
+    bool loadRom(const string &file, vector<uint16_t> &rom, string &message)
+    {
+        filesystem::path path = directory / file;
+        error_code ec;
+        if (path.extension() == ".hack" && !filesystem::exists(path, ec))
+            path.replace_extension(".asm");
+        string diagnostics;
+        if (!loadProgram(path.string(), options, rom, diagnostics))
+        {
+            message = diagnostics.empty() ? "cannot load " + file : diagnostics.substr(0, diagnostics.size() - 1);
+            return false;
+        }
+        return true;
+    }
+
+    bool emit(const string &line, string &message)
+    {
+        output += line + "\n";
+        if (!comparing)
+            return true;
+        size_t number = compared++;
+        bool same = number < expected.size() && expected[number].size() == line.size();
+        for (size_t i = 0; same && i < line.size(); i++)
+            same = expected[number][i] == line[i] || expected[number][i] == '*';
+        if (!same)
+        {
+            message = "comparison failure at line " + to_string(number + 1) + ": expected '" +
+                      (number < expected.size() ? expected[number] : "") + "', got '" + line + "'";
+            return false;
+        }
+        return true;
+    }
+
+    bool variable(const string &name, int &value)
+    {
+        if (name == "A")
+            value = emulator.a;
+        else if (name == "D")
+            value = emulator.d;
+        else if (name == "PC")
+            value = emulator.pc;
+        else if (name == "time")
+            value = (int)cycles;
+        else
+        {
+            int address = ramIndex(name);
+            if (address < 0)
+                return false;
+            value = emulator.ram[address];
+        }
+        return true;
+    }
+
+    bool set(const string &name, const string &text)
+    {
+        // values are decimal, or %D, %X or %B followed by the digits
+        int base = 10;
+        const char *digits = text.c_str();
+        if (text.size() > 2 && text[0] == '%')
+        {
+            base = text[1] == 'X' ? 16 : text[1] == 'B' ? 2 : 10;
+            digits += 2;
+        }
+        char *end;
+        long value = strtol(digits, &end, base);
+        if (*end)
+            return false;
+        // a new A or pc can leave a halt loop
+        if (name == "A")
+            emulator.a = (uint16_t)value;
+        else if (name == "D")
+            emulator.d = (uint16_t)value;
+        else if (name == "PC")
+            emulator.pc = (uint16_t)(value & 0x7FFF);
+        else
+        {
+            int address = ramIndex(name);
+            if (address < 0)
+                return false;
+            emulator.poke(address, (uint16_t)value);
+            return true;
+        }
+        emulator.halted = false;
+        return true;
+    }
+
+    // the address of RAM[i], -1 for anything else
+    static int ramIndex(const string &name)
+    {
+        if (name.compare(0, 4, "RAM[") != 0 || name.back() != ']')
+            return -1;
+        return ramAddress(name.substr(4, name.size() - 5));
+    }
+
+    static string format(const TestColumn &column, int value)
+    {
+        string text;
+        if (column.format == 'X' || column.format == 'B')
+        {
+            int bits = column.format == 'X' ? 4 : 1;
+            for (int shift = 16 - bits; shift >= 0; shift -= bits)
+                text += "0123456789ABCDEF"[(value >> shift) & ((1 << bits) - 1)];
+            if ((int)text.size() > column.width)
+                text = text.substr(text.size() - column.width);
+        }
+        else
+            text = to_string(column.format == 'D' ? (int16_t)value : value);
+        if ((int)text.size() < column.width)
+            text = string(column.width - text.size(), ' ') + text;
+        return text.substr(0, column.width);
+    }
+};
+
+// 64-bit hash of a byte buffer, 8 bytes per step
+uint64_t hashBytes(const char *p, size_t n, uint64_t seed)
+{
+    uint64_t h = seed ^ (n * 0x9E3779B97F4A7C15ull);
+    for (; n >= 8; p += 8, n -= 8)
+    {
+        uint64_t w;
+        memcpy(&w, p, 8);
+        h = mixHash(h ^ w, 0);
+    }
+    uint64_t w = 0;
+    memcpy(&w, p, n);
+    return mixHash(h ^ w, n);
+}
+
+// copies a file, cloning or copying in the kernel where the platform can;
+// on failure the partial copy is removed
+bool copyFile(const string &from, const string &to)
+{
+#ifdef __linux__
+    int in = open(from.c_str(), O_RDONLY);
+    if (in < 0)
+        return false;
+    int out = open(to.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out < 0)
+    {
+        close(in);
+        return false;
+    }
+    bool ok = ioctl(out, FICLONE, in) == 0; // reflink on btrfs/xfs
+    if (!ok)
+    {
+        ssize_t n;
+        while ((n = copy_file_range(in, nullptr, out, nullptr, 1 << 30, 0)) > 0)
+            ;
+        ok = n == 0;
+        if (!ok)
+        {
+            // no copy_file_range across these file systems, copy by hand
+            char buffer[1 << 16];
+            ok = lseek(in, 0, SEEK_SET) == 0 && ftruncate(out, 0) == 0 && lseek(out, 0, SEEK_SET) == 0;
+            while (ok && (n = read(in, buffer, sizeof(buffer))) > 0)
+                ok = write(out, buffer, n) == n;
+            ok = ok && n == 0;
+        }
+    }
+    close(in);
+    ok = close(out) == 0 && ok;
+    if (!ok)
+        unlink(to.c_str());
+    return ok;
+#else
+    error_code ec;
+    filesystem::copy_file(from, to, filesystem::copy_options::overwrite_existing, ec);
+    if (ec)
+        filesystem::remove(to, ec);
+    return !ec;
+#endif
+}
+
+// on-disk cache of assembled programs, keyed by the hash of the source
+// bytes, the assembler version and the output format. Each entry is a
+// directory holding the .hack file and the source it was built from; the
+// key is only 64 bits, so a hit also compares the source. Entries never
+// change once in place. A hit touches the entry so eviction can drop the
+// least recently used ones once the directory exceeds maxBytes.
+class AssemblyCache
+{
+public:
+    string directory;
+    uint64_t maxBytes;
+
+    AssemblyCache(string dir, uint64_t limit)
+    {
+        directory = dir;
+        maxBytes = limit;
+        error_code ec;
+        filesystem::create_directories(directory, ec);
+    }
+
+    string key(string_view source)
+    {
+        const char *tag = ASSEMBLER_VERSION "/hack";
+        uint64_t h = hashBytes(source.data(), source.size(), hashBytes(tag, strlen(tag), 0));
+        char hex[17];
+        snprintf(hex, sizeof(hex), "%016llx", (unsigned long long)h);
+        return hex;
+    }
+
+    // materializes the entry built from source as outputFileName, returns
+    // false on a miss
+    bool fetch(const string &key, string_view source, const string &outputFileName)
+    {
+        string entry = entryPath(key);
+        string cached;
+        bool hit = readFile(entry + "/source.asm", cached) && cached == source &&
+                   copyFile(entry + "/output.hack", outputFileName);
+        if (hit)
+        {
+            error_code ec;
+            filesystem::last_write_time(entry, filesystem::file_time_type::clock::now(), ec);
+        }
+        record(hit);
+        return hit;
+    }
+
+    void store(const string &key, string_view source, const string &text)
+    {
+        // build the entry under a temporary name so concurrent jobs never
+        // see half of it; if another job stored the key first, its entry stays
+        string entry = entryPath(key);
+        string temp = entry + ".tmp" + to_string(random_device()());
+        error_code ec;
+        if (!filesystem::create_directory(temp, ec) || !writeFile(temp + "/source.asm", source) ||
+            !writeFile(temp + "/output.hack", text))
+        {
+            filesystem::remove_all(temp, ec);
+            return;
+        }
+        filesystem::rename(temp, entry, ec);
+        if (ec)
+            filesystem::remove_all(temp, ec);
+        evict();
+    }
+
+    void printStats(ostream &out)
+    {
+        uint64_t counters[2];
+        readCounters(counters);
+        uint64_t hits = counters[0], misses = counters[1];
+        uint64_t entries = 0, bytes = 0;
+        error_code ec;
+        for (auto &e : filesystem::directory_iterator(directory, ec))
+        {
+            if (isEntry(e.path()))
+            {
+                entries++;
+                bytes += entrySize(e.path());
+            }
+        }
+        out << "hits: " << hits << "\nmisses: " << misses << "\nhit rate: "
+            << (hits + misses ? 100 * hits / (hits + misses) : 0) << "%\nentries: " << entries
+            << "\nbytes: " << bytes << " (limit " << maxBytes << ")" << endl;
+    }
+
+private:
+    string entryPath(const string &key)
+    {
+        return directory + "/" + key;
+    }
+
+    // entries are the directories named by a key, not the temporary ones
+    static bool isEntry(const filesystem::path &path)
+    {
+        error_code ec;
+        return path.filename().string().size() == 16 && filesystem::is_directory(path, ec);
+    }
+
+    static uint64_t entrySize(const filesystem::path &entry)
+    {
+        error_code ec;
+        uint64_t size = 0;
+        for (const char *name : {"source.asm", "output.hack"})
+        {
+            uint64_t n = filesystem::file_size(entry / name, ec);
+            size += ec ? 0 : n;
+        }
+        return size;
+    }
+
+    // the hit and miss counters, two 64-bit words in the stats file
+    void readCounters(uint64_t counters[2])
+    {
+        counters[0] = counters[1] = 0;
+        ifstream stats(directory + "/stats", ios::binary);
+        stats.read((char *)counters, 2 * sizeof(uint64_t));
+        if (!stats)
+            counters[0] = counters[1] = 0;
+    }
+
+    // adds one to the hit or miss counter, under a file lock where there is
+    // one so concurrent jobs do not lose each other's updates
+    void record(bool hit)
+    {
+        string path = directory + "/stats";
+#ifdef __linux__
+        int fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+        if (fd < 0)
+            return;
+        if (flock(fd, LOCK_EX) == 0)
+        {
+            uint64_t counters[2] = {0, 0};
+            if (pread(fd, counters, sizeof(counters), 0) != (ssize_t)sizeof(counters))
+                counters[0] = counters[1] = 0;
+            counters[hit ? 0 : 1]++;
+            if (pwrite(fd, counters, sizeof(counters), 0) != (ssize_t)sizeof(counters))
+                cerr << path << ": warning: cannot update the cache statistics" << endl;
+        }
+        close(fd); // releases the lock
+#else
+        uint64_t counters[2];
+        readCounters(counters);
+        counters[hit ? 0 : 1]++;
+        ofstream stats(path, ios::binary);
+        stats.write((const char *)counters, sizeof(counters));
+#endif
+    }
+
+    // removes the least recently used entries until the cache fits
+    void evict()
+    {
+        vector<pair<filesystem::file_time_type, filesystem::path>> entries;
+        uint64_t total = 0;
+        error_code ec;
+        for (auto &e : filesystem::directory_iterator(directory, ec))
+        {
+            if (!isEntry(e.path()))
+                continue;
+            total += entrySize(e.path());
+            entries.push_back(make_pair(e.last_write_time(ec), e.path()));
+        }
+        if (total <= maxBytes)
+            return;
+        sort(entries.begin(), entries.end());
+        for (size_t i = 0; i < entries.size() && total > maxBytes; i++)
+        {
+            uint64_t size = entrySize(entries[i].second);
+            if (filesystem::remove_all(entries[i].second, ec) > 0)
+                total -= size;
+        }
+    }
+};
+
+// size and modification time of a file in nanoseconds, false if it is missing
+bool fileStamp(const string &fileName, uint64_t &size, int64_t &time)
+{
+#ifdef __linux__
+    struct stat st;
+    if (stat(fileName.c_str(), &st) != 0)
+        return false;
+    size = st.st_size;
+    time = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+    return true;
+#else
+    error_code ec;
+    size = filesystem::file_size(fileName, ec);
+    if (ec)
+        return false;
+    time = chrono::duration_cast<chrono::nanoseconds>(filesystem::last_write_time(fileName, ec).time_since_epoch()).count();
+    return !ec;
+#endif
+}
+
+// what the manifest remembers about one target
+struct ManifestEntry
+{
+    string output;
+    uint64_t inputSize;
+    int64_t inputTime;
+    uint64_t inputHash;
+    uint64_t optionsHash;
+    uint64_t outputSize;
+    int64_t outputTime;
+    uint64_t outputHash;
+};
+
+// a minimal build graph: every input.asm has one target, input.hack, and
+// the manifest records the input's content hash, the options and the
+// output's hash from the last build. A target whose input and output
+// still have the recorded size and mtime is up to date without reading
+// either; if only the stamps moved the hashes decide. Stale targets are
+// assembled on the thread pool.
+class BuildManifest
+{
+public:
+    BuildManifest(const string &fileName)
+    {
+        manifestFileName = fileName;
+        const char *tag = ASSEMBLER_VERSION "/hack";
+        optionsHash = hashBytes(tag, strlen(tag), 0);
+        load();
+    }
+
+    // builds the targets of inputs, returns false if any failed
+    bool build(const vector<string> &inputs, ThreadPool &pool)
+    {
+        vector<ManifestEntry> next(inputs.size());
+        vector<size_t> stale;
+        for (size_t i = 0; i < inputs.size(); i++)
+        {
+            if (!upToDate(inputs[i], next[i]))
+                stale.push_back(i);
+        }
+        vector<string> diagnostics(inputs.size());
+        vector<char> failed(inputs.size(), 0);
+        pool.parallelFor(stale.size(), [&](size_t s) {
+            size_t i = stale[s];
+            failed[i] = !assembleTarget(inputs[i], next[i], diagnostics[i]);
+        });
+        size_t failures = 0;
+        bool changed = rehashed;
+        for (size_t i = 0; i < inputs.size(); i++)
+        {
+            cerr << diagnostics[i];
+            if (failed[i])
+            {
+                changed = entries.erase(inputs[i]) || changed; // so the next build retries it
+                failures++;
+            }
+            else if (!sameEntry(inputs[i], next[i]))
+            {
+                entries[inputs[i]] = next[i];
+                changed = true;
+            }
+        }
+        bool saved = !changed || save();
+        cerr << manifestFileName << ": " << inputs.size() << " targets, " << stale.size() - failures << " rebuilt, "
+             << failures << " failed" << endl;
+        return saved && failures == 0;
+    }
+
+private:
+    string manifestFileName;
+    uint64_t optionsHash;
+    int64_t manifestTime = 0; // mtime of the manifest when it was loaded
+    bool rehashed = false;
+    unordered_map<string, ManifestEntry> entries;
+
+    bool sameEntry(const string &input, const ManifestEntry &entry)
+    {
+        auto recorded = entries.find(input);
+        return recorded != entries.end() && recorded->second.inputSize == entry.inputSize &&
+               recorded->second.inputTime == entry.inputTime && recorded->second.outputSize == entry.outputSize &&
+               recorded->second.outputTime == entry.outputTime && recorded->second.inputHash == entry.inputHash &&
+               recorded->second.outputHash == entry.outputHash;
+    }
+
+    static string outputName(const string &input)
+    {
+        return filesystem::path(input).replace_extension(".hack").string();
+    }
+
+    // fills entry with the target's current state, true if it needs no build
+    bool upToDate(const string &input, ManifestEntry &entry)
+    {
+        entry.output = outputName(input);
+        entry.optionsHash = optionsHash;
+        if (!fileStamp(input, entry.inputSize, entry.inputTime))
+            return false;
+        auto recorded = entries.find(input);
+        if (recorded == entries.end() || recorded->second.optionsHash != optionsHash ||
+            recorded->second.output != entry.output)
+            return false;
+        const ManifestEntry &old = recorded->second;
+        if (!fileStamp(entry.output, entry.outputSize, entry.outputTime))
+            return false;
+        entry.inputHash = old.inputHash;
+        entry.outputHash = old.outputHash;
+        // an input written in the same clock tick as the manifest could
+        // have changed again without moving its mtime, so check its hash
+        bool racy = old.inputTime >= manifestTime;
+        if (!racy && entry.inputSize == old.inputSize && entry.inputTime == old.inputTime &&
+            entry.outputSize == old.outputSize && entry.outputTime == old.outputTime)
+            return true;
+        string contents;
+        if (!readFile(input, contents) || hashBytes(contents.data(), contents.size(), 0) != old.inputHash ||
+            !readFile(entry.output, contents) || hashBytes(contents.data(), contents.size(), 0) != old.outputHash)
+            return false;
+        rehashed = true; // save so the new stamps spare the next build the hashing
+        return true;
+    }
+
+    bool assembleTarget(const string &input, ManifestEntry &entry, string &diagnostics)
+    {
+        string source;
+        if (!readFile(input, source))
+        {
+            diagnostics = input + ": error: cannot open file\n";
+            return false;
+        }
+        vector<uint16_t> rom;
+        if (!assemble(source, input, Options(), rom, diagnostics))
+            return false;
+        string text = hackText(rom);
+        if (!writeFile(entry.output, text))
+        {
+            diagnostics += entry.output + ": error: cannot write file\n";
+            return false;
+        }
+        entry.inputHash = hashBytes(source.data(), source.size(), 0);
+        entry.outputHash = hashBytes(text.data(), text.size(), 0);
+        // stamp what was read, not what is there now, so an edit during
+        // the build still makes the target stale
+        entry.inputSize = source.size();
+        return fileStamp(entry.output, entry.outputSize, entry.outputTime);
+    }
+
+    // one target per line: input, output and the recorded state, tab separated
+    void load()
+    {
+        uint64_t size;
+        if (!fileStamp(manifestFileName, size, manifestTime))
+            return;
+        ifstream in(manifestFileName);
+        string line;
+        while (getline(in, line))
+        {
+            size_t a = line.find('\t');
+            size_t b = a == string::npos ? a : line.find('\t', a + 1);
+            if (b == string::npos)
+                continue;
+            ManifestEntry entry;
+            entry.output = line.substr(a + 1, b - a - 1);
+            unsigned long long v[7];
+            if (sscanf(line.c_str() + b + 1, "%llu %lld %llx %llx %llu %lld %llx", &v[0], (long long *)&v[1], &v[2], &v[3],
+                       &v[4], (long long *)&v[5], &v[6]) != 7)
+                continue;
+            entry.inputSize = v[0];
+            entry.inputTime = (int64_t)v[1];
+            entry.inputHash = v[2];
+            entry.optionsHash = v[3];
+            entry.outputSize = v[4];
+            entry.outputTime = (int64_t)v[5];
+            entry.outputHash = v[6];
+            entries[line.substr(0, a)] = entry;
+        }
+    }
+
+    bool save()
+    {
+        string text;
+        char fields[160];
+        for (auto &e : entries)
+        {
+            const ManifestEntry &entry = e.second;
+            snprintf(fields, sizeof(fields), "%llu %lld %016llx %016llx %llu %lld %016llx\n",
+                     (unsigned long long)entry.inputSize, (long long)entry.inputTime,
+                     (unsigned long long)entry.inputHash, (unsigned long long)entry.optionsHash,
+                     (unsigned long long)entry.outputSize, (long long)entry.outputTime,
+                     (unsigned long long)entry.outputHash);
+            text += e.first + "\t" + entry.output + "\t" + fields;
+        }
+        // replace the manifest in one step so an interrupted build keeps the old one
+        string temp = manifestFileName + ".tmp";
+        error_code ec;
+        if (!writeFile(temp, text))
+            return false;
+        filesystem::rename(temp, manifestFileName, ec);
+        return !ec;
+    }
+};
+
+// limits on one graded submission
+struct GradeLimits
+{
+    uint64_t cycles = DEFAULT_CYCLES; // per test script
+    double seconds = 10;              // CPU time per submission
+    uint64_t bytes = 1 << 20;         // source size
+};
+
+struct TestOutcome
+{
+    string test;
+    bool passed;
+    uint64_t cycles;
+    double ms;
+    string message;
+};
+
+struct Submission
+{
+    string fileName;
+    uint64_t hash = 0;     // of the source, 0 if it was rejected unread
+    long duplicateOf = -1; // index of the first submission with the same source
+    bool assembled = false;
+    string message; // why it did not assemble
+    vector<TestOutcome> outcomes;
+    double ms = 0;
+
+    size_t passed() const
+    {
+        size_t n = 0;
+        for (const TestOutcome &outcome : outcomes)
+            n += outcome.passed;
+        return n;
+    }
+};
+
+static string jsonString(const string &s)
+{
+    string out = "\"";
+    for (char c : s)
+    {
+        if (c == '"' || c == '\\')
+            out += string("\\") + c;
+        else if ((unsigned char)c < 0x20)
+        {
+            char escape[8];
+            snprintf(escape, sizeof(escape), "\\u%04x", c);
+            out += escape;
+        }
+        else
+            out += c;
+    }
+    return out + "\"";
+}
+
+static string csvString(const string &s)
+{
+    string out = "\"";
+    for (char c : s)
+        out += c == '"' ? string("\"\"") : string(1, c);
+    return out + "\"";
+}
+
+// grades every .asm under directory with the test scripts: identical
+// sources are graded once, the rest run in parallel on pool, each test
+// with the submission loaded in place of the program the script names.
+// Writes a JSON report, or CSV if reportFileName ends in .csv.
+bool gradeSubmissions(const string &directory, const vector<string> &scripts, const GradeLimits &limits,
+                      const Options &options, ThreadPool &pool, const string &reportFileName)
+{
+    vector<Submission> submissions;
+    error_code ec;
+    for (auto &e : filesystem::recursive_directory_iterator(directory, ec))
+    {
+        if (e.is_regular_file(ec) && e.path().extension() == ".asm")
+        {
+            submissions.push_back(Submission());
+            submissions.back().fileName = e.path().string();
+        }
+    }
+    if (ec)
+    {
+        cerr << directory << ": error: " << ec.message() << endl;
+        return false;
+    }
+    sort(submissions.begin(), submissions.end(),
+         [](const Submission &x, const Submission &y) { return x.fileName < y.fileName; });
+
+    vector<string> sources(submissions.size());
+    pool.parallelFor(submissions.size(), [&](size_t i) {
+        Submission &submission = submissions[i];
+        uint64_t size;
+        int64_t time;
+        if (fileStamp(submission.fileName, size, time) && size > limits.bytes)
+            submission.message = "source larger than " + to_string(limits.bytes) + " bytes";
+        else if (!readFile(submission.fileName, sources[i]))
+            submission.message = "cannot open file";
+        else
+            submission.hash = hashBytes(sources[i].data(), sources[i].size(), 0);
+    });
+    // only sources that were read take part, a rejected one has nothing to share
+    vector<size_t> unique;
+    unordered_map<uint64_t, size_t> first;
+    for (size_t i = 0; i < submissions.size(); i++)
+    {
+        if (!submissions[i].message.empty())
+        {
+            unique.push_back(i);
+            continue;
+        }
+        auto found = first.insert(make_pair(submissions[i].hash, i));
+        // a hash match is checked byte for byte before trusting it
+        if (!found.second && sources[found.first->second] == sources[i])
+            submissions[i].duplicateOf = (long)found.first->second;
+        else
+            unique.push_back(i);
+    }
+
+    auto start = chrono::steady_clock::now();
+    pool.parallelFor(unique.size(), [&](size_t u) {
+        Submission &submission = submissions[unique[u]];
+        auto begin = chrono::steady_clock::now();
+        double cpuStart = cpuSeconds();
+        vector<uint16_t> rom;
+        string diagnostics;
+        if (submission.message.empty())
+        {
+            submission.assembled = assemble(sources[unique[u]], submission.fileName, options, rom, diagnostics) &&
+                                   rom.size() <= ROM_SIZE;
+            submission.message = diagnostics.substr(0, diagnostics.find('\n'));
+            if (diagnostics.empty() && !submission.assembled)
+                submission.message = "program does not fit in ROM";
+        }
+        for (size_t t = 0; submission.assembled && t < scripts.size(); t++)
+        {
+            auto testStart = chrono::steady_clock::now();
+            TestScript script(scripts[t], options, limits.cycles);
+            script.program = &rom;
+            script.writeOutput = false;
+            script.cycleLimit = limits.cycles;
+            script.cpuLimit = max(1e-6, limits.seconds - (cpuSeconds() - cpuStart));
+            TestOutcome outcome;
+            outcome.test = scripts[t];
+            outcome.passed = script.run(outcome.message);
+            outcome.cycles = script.cycles;
+            outcome.ms = chrono::duration<double, milli>(chrono::steady_clock::now() - testStart).count();
+            submission.outcomes.push_back(outcome);
+        }
+        sources[unique[u]].clear();
+        submission.ms = chrono::duration<double, milli>(chrono::steady_clock::now() - begin).count();
+    });
+    for (Submission &submission : submissions)
+    {
+        if (submission.duplicateOf < 0)
+            continue;
+        const Submission &original = submissions[submission.duplicateOf];
+        submission.assembled = original.assembled;
+        submission.message = original.message;
+        submission.outcomes = original.outcomes;
+    }
+    double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+
+    string report;
+    char hash[17];
+    bool csv = filesystem::path(reportFileName).extension() == ".csv";
+    if (csv)
+        report = "file,hash,duplicate_of,assembled,passed,tests,cycles,ms,message\n";
+    else
+        report = "{\n  \"tests\": [";
+    for (size_t t = 0; !csv && t < scripts.size(); t++)
+        report += (t ? ", " : "") + jsonString(scripts[t]);
+    if (!csv)
+        report += "],\n  \"submissions\": [";
+    size_t perfect = 0;
+    for (size_t i = 0; i < submissions.size(); i++)
+    {
+        const Submission &submission = submissions[i];
+        snprintf(hash, sizeof(hash), "%016llx", (unsigned long long)submission.hash);
+        string duplicate = submission.duplicateOf < 0 ? "" : submissions[submission.duplicateOf].fileName;
+        uint64_t cycles = 0;
+        string message = submission.message;
+        for (const TestOutcome &outcome : submission.outcomes)
+        {
+            cycles += outcome.cycles;
+            if (message.empty() && !outcome.passed)
+                message = outcome.test + ": " + outcome.message;
+        }
+        perfect += submission.assembled && submission.passed() == scripts.size();
+        if (csv)
+        {
+            report += csvString(submission.fileName) + "," + hash + "," + csvString(duplicate) + "," +
+                      (submission.assembled ? "true" : "false") + "," + to_string(submission.passed()) + "," +
+                      to_string(scripts.size()) + "," + to_string(cycles) + "," + to_string(submission.ms) + "," +
+                      csvString(message) + "\n";
+            continue;
+        }
+        report += string(i ? "," : "") + "\n    {\"file\": " + jsonString(submission.fileName) + ", \"hash\": \"" + hash +
+                  "\", \"duplicateOf\": " + (duplicate.empty() ? "null" : jsonString(duplicate)) +
+                  ", \"assembled\": " + (submission.assembled ? "true" : "false") +
+                  ", \"passed\": " + to_string(submission.passed()) + ", \"tests\": " + to_string(scripts.size()) +
+                  ", \"cycles\": " + to_string(cycles) + ", \"ms\": " + to_string(submission.ms) +
+                  ", \"message\": " + jsonString(message) + ", \"results\": [";
+        for (size_t t = 0; t < submission.outcomes.size(); t++)
+        {
+            const TestOutcome &outcome = submission.outcomes[t];
+            report += string(t ? ", " : "") + "{\"test\": " + jsonString(outcome.test) +
+                      ", \"passed\": " + (outcome.passed ? "true" : "false") + ", \"cycles\": " +
+                      to_string(outcome.cycles) + ", \"ms\": " + to_string(outcome.ms) +
+                      ", \"message\": " + jsonString(outcome.message) + "}";
+        }
+        report += "]}";
+    }
+    if (!csv)
+        report += "\n  ]\n}\n";
+    cerr << submissions.size() << " submissions (" << unique.size() << " distinct), " << perfect
+         << " passed every test, graded in " << ms << " ms" << endl;
+    if (!writeFile(reportFileName, report))
+    {
+        cerr << reportFileName << ": error: cannot write file" << endl;
+        return false;
+    }
+    return true;
+}
+
+// the outcome of assembling one source
+struct AssemblyResult
+{
+    bool ok;
+    string text; // the .hack file when ok
+    string diagnostics;
+};
+
+// in-memory LRU of assembly results keyed by the hash of name and source;
+// the hash is only 64 bits, so an entry keeps both and a hit must match them
+class ResultCache
+{
+public:
+    ResultCache(uint64_t limit)
+    {
+        maxBytes = limit;
+        bytes = 0;
+    }
+
+    bool get(uint64_t key, const string &name, const string &source, AssemblyResult &result)
+    {
+        lock_guard<mutex> guard(lock);
+        auto it = index.find(key);
+        if (it == index.end() || it->second->name != name || it->second->source != source)
+            return false;
+        entries.splice(entries.begin(), entries, it->second);
+        result = it->second->result;
+        return true;
+    }
+
+    void put(uint64_t key, const string &name, const string &source, const AssemblyResult &result)
+    {
+        lock_guard<mutex> guard(lock);
+        if (index.count(key))
+            return;
+        entries.push_front(Entry{key, name, source, result});
+        index[key] = entries.begin();
+        bytes += cost(entries.front());
+        while (bytes > maxBytes && !entries.empty())
+        {
+            bytes -= cost(entries.back());
+            index.erase(entries.back().key);
+            entries.pop_back();
+        }
+    }
+
+private:
+    struct Entry
+    {
+        uint64_t key;
+        string name;
+        string source;
+        AssemblyResult result;
+    };
+    mutex lock;
+    list<Entry> entries; // most recently used first
+    unordered_map<uint64_t, list<Entry>::iterator> index;
+    uint64_t maxBytes;
+    uint64_t bytes;
+
+    static uint64_t cost(const Entry &e)
+    {
+        return e.name.size() + e.source.size() + e.result.text.size() + e.result.diagnostics.size() + 64;
+    }
+};
+
+#ifdef HAVE_UNIX_SOCKETS
+
+// daemon protocol, all integers in host byte order (the socket is local)
+// request:  uint32 kind, uint32 name length, uint64 payload length, name, payload
+//           REQUEST_SOURCE: payload is the source, name is used in diagnostics
+//           REQUEST_PATH:   name is a file for the daemon to read, no payload
+//           REQUEST_FD:     no payload, the header carries one or two file
+//                           descriptors (SCM_RIGHTS): the source, and
+//                           optionally a file to write the output into
+// response: uint32 ok, uint32 flags, uint64 text length, uint64 diagnostics length,
+//           text, diagnostics
+//           with RESPONSE_TEXT_IN_FD the text is not sent: it was written into
+//           the client's output descriptor, or into a memfd attached to the header
+#define REQUEST_SOURCE 1
+#define REQUEST_PATH 2
+#define REQUEST_FD 3
+
+#define RESPONSE_TEXT_IN_FD 1
+
+// a request naming a longer file or sending a larger source is refused,
+// before anything is allocated for it
+#define DAEMON_MAX_NAME 4096
+#define DAEMON_MAX_PAYLOAD (256ull << 20)
+
+// seconds a socket read or write may stall before the daemon drops the
+// connection, or the client gives up and assembles in-process
+#define DAEMON_TIMEOUT 10
+
+// seconds a connection may sit without sending a request
+#define DAEMON_IDLE 60
+
+struct RequestHeader
+{
+    uint32_t kind;
+    uint32_t nameLength;
+    uint64_t payloadLength;
+};
+
+struct ResponseHeader
+{
+    uint32_t ok;
+    uint32_t flags;
+    uint64_t textLength;
+    uint64_t diagnosticsLength;
+};
+
+bool readAll(int fd, void *data, size_t size)
+{
+    char *p = (char *)data;
+    while (size > 0)
+    {
+        ssize_t n = read(fd, p, size);
+        if (n <= 0)
+            return false;
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+bool writeAll(int fd, const void *data, size_t size)
+{
+    const char *p = (const char *)data;
+    while (size > 0)
+    {
+        ssize_t n = write(fd, p, size);
+        if (n <= 0)
+            return false;
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+// reads exactly size bytes, collecting up to maxFds descriptors sent along
+bool readWithFds(int fd, void *data, size_t size, int *fds, int maxFds, int &count)
+{
+    count = 0;
+    char control[CMSG_SPACE(sizeof(int) * 4)];
+    iovec iov;
+    iov.iov_base = data;
+    iov.iov_len = size;
+    msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+    ssize_t n = recvmsg(fd, &message, 0);
+    if (n <= 0)
+        return false;
+    for (cmsghdr *c = CMSG_FIRSTHDR(&message); c; c = CMSG_NXTHDR(&message, c))
+    {
+        if (c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS)
+            continue;
+        int received = (int)((c->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+        int *p = (int *)CMSG_DATA(c);
+        for (int i = 0; i < received; i++)
+        {
+            if (count < maxFds)
+                fds[count++] = p[i];
+            else
+                close(p[i]);
+        }
+    }
+    return readAll(fd, (char *)data + n, size - n);
+}
+
+// writes data with count descriptors attached to its first byte
+bool writeWithFds(int fd, const void *data, size_t size, const int *fds, int count)
+{
+    if (count == 0)
+        return writeAll(fd, data, size);
+    char control[CMSG_SPACE(sizeof(int) * 4)];
+    memset(control, 0, sizeof(control));
+    iovec iov;
+    iov.iov_base = (void *)data;
+    iov.iov_len = size;
+    msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = CMSG_SPACE(sizeof(int) * count);
+    cmsghdr *c = CMSG_FIRSTHDR(&message);
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type = SCM_RIGHTS;
+    c->cmsg_len = CMSG_LEN(sizeof(int) * count);
+    memcpy(CMSG_DATA(c), fds, sizeof(int) * count);
+    ssize_t n = sendmsg(fd, &message, 0);
+    if (n <= 0)
+        return false;
+    return writeAll(fd, (const char *)data + n, size - n);
+}
+
+// makes reads and writes on fd fail after seconds without progress
+void setTimeout(int fd, int seconds)
+{
+    timeval limit;
+    limit.tv_sec = seconds;
+    limit.tv_usec = 0;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &limit, sizeof(limit));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &limit, sizeof(limit));
+}
+
+// whether the process at the other end of a connection runs as this user
+bool sameUser(int fd)
+{
+#if defined(__linux__)
+    ucred peer;
+    socklen_t length = sizeof(peer);
+    return getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &peer, &length) == 0 && peer.uid == geteuid();
+#else
+    uid_t uid;
+    gid_t gid;
+    return getpeereid(fd, &uid, &gid) == 0 && uid == geteuid();
+#endif
+}
+
+bool socketAddress(const string &path, sockaddr_un &address)
+{
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path))
+        return false;
+    memcpy(address.sun_path, path.c_str(), path.size());
+    return true;
+}
+
+// long-running server: accepts connections on a Unix socket and serves
+// their requests on a warm thread pool, reusing results of identical
+// sources from an in-memory cache. Connections are polled between
+// requests, so a worker is only held while a request is being served.
+class Daemon
+{
+public:
+    Daemon(const Options &o, size_t threads, uint64_t cacheBytes) : pool(threads), results(cacheBytes)
+    {
+        options = o;
+    }
+
+    int run(const string &socketPath)
+    {
+        sockaddr_un address;
+        if (!socketAddress(socketPath, address))
+        {
+            cerr << socketPath << ": error: socket path too long" << endl;
+            return 1;
+        }
+        int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+        unlink(socketPath.c_str()); // a stale socket from an earlier run
+        // requests read files with the daemon's rights, so only its own
+        // user may connect: the socket is created 0600 and every peer's
+        // uid is checked as well
+        mode_t mask = umask(0177);
+        bool bound = listener >= 0 && bind(listener, (sockaddr *)&address, sizeof(address)) == 0;
+        umask(mask);
+        if (!bound || listen(listener, 128) < 0 || pipe(wake) < 0)
+        {
+            cerr << socketPath << ": error: " << strerror(errno) << endl;
+            return 1;
+        }
+        signal(SIGPIPE, SIG_IGN);
+        cerr << "listening on " << socketPath << " with " << pool.size() << " threads" << endl;
+        // connections waiting for their next request, and since when
+        vector<pair<int, chrono::steady_clock::time_point>> idle;
+        vector<pollfd> polled;
+        for (;;)
+        {
+            polled.resize(2 + idle.size());
+            polled[0].fd = listener;
+            polled[1].fd = wake[0];
+            for (size_t i = 0; i < idle.size(); i++)
+                polled[2 + i].fd = idle[i].first;
+            for (pollfd &p : polled)
+            {
+                p.events = POLLIN;
+                p.revents = 0;
+            }
+            if (poll(polled.data(), polled.size(), 1000) < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                break;
+            }
+            auto now = chrono::steady_clock::now();
+            // a readable connection gets a worker for one request, one
+            // idle for too long is closed
+            size_t kept = 0;
+            for (size_t i = 0; i < idle.size(); i++)
+            {
+                int connection = idle[i].first;
+                if (polled[2 + i].revents)
+                    pool.submit([this, connection] { serve(connection); });
+                else if (now - idle[i].second > chrono::seconds(DAEMON_IDLE))
+                    close(connection);
+                else
+                    idle[kept++] = idle[i];
+            }
+            idle.resize(kept);
+            char drained[64];
+            if (polled[1].revents && read(wake[0], drained, sizeof(drained)) > 0)
+            {
+                lock_guard<mutex> guard(lock);
+                for (int connection : finished)
+                    idle.push_back({connection, now});
+                finished.clear();
+            }
+            if (polled[0].revents)
+            {
+                int connection = accept(listener, nullptr, nullptr);
+                if (connection >= 0 && !sameUser(connection))
+                    close(connection);
+                else if (connection >= 0)
+                {
+                    setTimeout(connection, DAEMON_TIMEOUT);
+                    idle.push_back({connection, now});
+                }
+                else if (errno != EINTR && errno != ECONNABORTED)
+                    break;
+            }
+        }
+        close(listener);
+        return 1;
+    }
+
+private:
+    Options options;
+    ThreadPool pool;
+    ResultCache results;
+    int wake[2];          // a worker writes a byte here when it hands back a connection
+    mutex lock;
+    vector<int> finished; // connections served and waiting to be polled again
+
+    // answers one request, then hands the connection back to the poll loop
+    void serve(int connection)
+    {
+        if (!serveRequest(connection))
+        {
+            close(connection);
+            return;
+        }
+        bool first;
+        {
+            lock_guard<mutex> guard(lock);
+            first = finished.empty();
+            finished.push_back(connection);
+        }
+        if (first)
+            writeAll(wake[1], "", 1);
+    }
+
+    // returns false if the connection is closed, broken or stalled, or
+    // sent a request too large to accept
+    bool serveRequest(int connection)
+    {
+        RequestHeader request;
+        int fds[2];
+        int count;
+        if (!readWithFds(connection, &request, sizeof(request), fds, 2, count))
+            return false;
+        bool ok = request.nameLength <= DAEMON_MAX_NAME && request.payloadLength <= DAEMON_MAX_PAYLOAD;
+        string name;
+        if (ok)
+        {
+            name.resize(request.nameLength);
+            ok = readAll(connection, &name[0], name.size());
+        }
+        if (ok && request.kind == REQUEST_FD)
+            ok = serveFd(connection, name, fds, count);
+        for (int i = 0; i < count; i++)
+            close(fds[i]);
+        if (!ok || request.kind == REQUEST_FD)
+            return ok;
+        string payload(request.payloadLength, '\0');
+        if (!readAll(connection, &payload[0], payload.size()))
+            return false;
+        AssemblyResult result;
+        if (request.kind == REQUEST_PATH && !readFile(name, payload))
+        {
+            result.ok = false;
+            result.diagnostics = name + ": error: cannot open file\n";
+        }
+        else
+            result = assembleCached(name, payload);
+        return reply(connection, result);
+    }
+
+    // assembles straight out of the client's source descriptor into its
+    // output descriptor (or a new memfd), so no program bytes cross the
+    // socket. These are the large jobs, they bypass the result cache.
+    bool serveFd(int connection, const string &name, int *fds, int count)
+    {
+        AssemblyResult result;
+        result.ok = false;
+        ResponseHeader response;
+        memset(&response, 0, sizeof(response));
+#ifdef __linux__
+        ClientSource source;
+        if (count > 0 && readSource(fds[0], source))
+        {
+            vector<uint16_t> rom;
+            result.ok = assemble(source.text, name, options, rom, result.diagnostics);
+            int out = count > 1 ? fds[1] : -1;
+            if (result.ok)
+            {
+                if (out < 0)
+                    out = memfd_create("hack", MFD_CLOEXEC);
+                result.ok = writeWords(out, rom, count < 2);
+                if (!result.ok)
+                    result.diagnostics += name + ": error: cannot write output\n";
+                response.textLength = rom.size() * 17;
+            }
+            response.flags = RESPONSE_TEXT_IN_FD;
+            response.ok = result.ok;
+            response.diagnosticsLength = result.diagnostics.size();
+            bool sent = writeWithFds(connection, &response, sizeof(response), &out, count > 1 || out < 0 ? 0 : 1) &&
+                        writeAll(connection, result.diagnostics.data(), result.diagnostics.size());
+            if (count < 2 && out >= 0)
+                close(out);
+            return sent;
+        }
+        result.diagnostics = name + ": error: the source descriptor is not a readable regular file\n";
+#else
+        result.diagnostics = name + ": error: cannot read the source descriptor\n";
+#endif
+        return reply(connection, result);
+    }
+
+#ifdef __linux__
+    // the source behind a client's descriptor
+    struct ClientSource
+    {
+        string copy;
+        void *map = nullptr;
+        size_t size = 0;
+        string_view text;
+
+        ~ClientSource()
+        {
+            if (map)
+                munmap(map, size);
+        }
+    };
+
+    // only a memfd sealed against shrinking and writing is mapped: the
+    // client could truncate any other file under the mapping (SIGBUS) or
+    // change it mid-assembly, so those are read with pread. Pipes, sockets
+    // and other descriptors that are not regular files are refused.
+    static bool readSource(int fd, ClientSource &source)
+    {
+        struct stat info;
+        if (fstat(fd, &info) != 0 || !S_ISREG(info.st_mode))
+            return false;
+        size_t size = (size_t)info.st_size;
+        int seals = fcntl(fd, F_GET_SEALS);
+        if (size > 0 && seals >= 0 && (seals & (F_SEAL_SHRINK | F_SEAL_WRITE)) == (F_SEAL_SHRINK | F_SEAL_WRITE))
+        {
+            void *map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (map == MAP_FAILED)
+                return false;
+            source.map = map;
+            source.size = size;
+            source.text = string_view((const char *)map, size);
+            return true;
+        }
+        source.copy.resize(size);
+        size_t done = 0;
+        while (done < size)
+        {
+            ssize_t n = pread(fd, &source.copy[done], size - done, (off_t)done);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0)
+                return false;
+            if (n == 0)
+                break; // the file shrank, assemble what is there
+            done += n;
+        }
+        source.copy.resize(done);
+        source.text = source.copy;
+        return true;
+    }
+
+    // formats the rom into the output descriptor. A memfd of the daemon's
+    // own is filled through a mapping; the client's file is written with
+    // pwrite, since the client could shrink a mapped file under the daemon.
+    static bool writeWords(int out, const vector<uint16_t> &rom, bool own)
+    {
+        size_t size = rom.size() * 17;
+        if (out < 0 || ftruncate(out, size) != 0)
+            return false;
+        if (size == 0)
+            return true;
+        if (!own)
+        {
+            const size_t words = 4096;
+            vector<char> buffer(words * 17);
+            for (size_t i = 0; i < rom.size(); i += words)
+            {
+                vector<uint16_t> chunk(rom.begin() + i, rom.begin() + min(rom.size(), i + words));
+                formatHack(chunk, buffer.data());
+                size_t length = chunk.size() * 17, done = 0;
+                while (done < length)
+                {
+                    ssize_t n = pwrite(out, buffer.data() + done, length - done, (off_t)(i * 17 + done));
+                    if (n < 0 && errno == EINTR)
+                        continue;
+                    if (n <= 0)
+                        return false;
+                    done += n;
+                }
+            }
+            return true;
+        }
+        void *map = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, out, 0);
+        if (map == MAP_FAILED)
+            return false;
+        formatHack(rom, (char *)map);
+        munmap(map, size);
+        return true;
+    }
+#endif
+
+    AssemblyResult assembleCached(const string &name, const string &source)
+    {
+        uint64_t key = hashBytes(source.data(), source.size(), hashBytes(name.data(), name.size(), 0));
+        AssemblyResult result;
+        if (results.get(key, name, source, result))
+            return result;
+        vector<uint16_t> rom;
+        result.ok = assemble(source, name, options, rom, result.diagnostics);
+        if (result.ok)
+            result.text = hackText(rom);
+        results.put(key, name, source, result);
+        return result;
+    }
+
+    bool reply(int connection, const AssemblyResult &result)
+    {
+        ResponseHeader response;
+        response.ok = result.ok;
+        response.flags = 0;
+        response.textLength = result.text.size();
+        response.diagnosticsLength = result.diagnostics.size();
+        return writeAll(connection, &response, sizeof(response)) &&
+               writeAll(connection, result.text.data(), result.text.size()) &&
+               writeAll(connection, result.diagnostics.data(), result.diagnostics.size());
+    }
+};
+
+// connects to a daemon, -1 if none is listening on socketPath
+int connectDaemon(const string &socketPath)
+{
+    sockaddr_un address;
+    if (!socketAddress(socketPath, address))
+        return -1;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+    if (connect(fd, (sockaddr *)&address, sizeof(address)) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+    // a daemon that stops answering or hangs up counts as none
+    setTimeout(fd, DAEMON_TIMEOUT);
+    signal(SIGPIPE, SIG_IGN);
+    return fd;
+}
+
+// assembles through a running daemon and writes outputFileName; returns
+// false if no daemon could be reached, so the caller can assemble
+// in-process instead. On Linux the files themselves are passed as
+// descriptors; elsewhere the daemon is sent the path.
+bool assembleRemote(const string &socketPath, const string &inputFileName, const string &outputFileName,
+                    AssemblyResult &result)
+{
+    int fd = connectDaemon(socketPath);
+    if (fd < 0)
+        return false;
+    RequestHeader request;
+    ResponseHeader response;
+    bool ok;
+#ifdef __linux__
+    int fds[2];
+    fds[0] = open(inputFileName.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fds[0] < 0)
+    {
+        close(fd);
+        result.ok = false;
+        result.diagnostics = inputFileName + ": error: cannot open file\n";
+        return true;
+    }
+    // a regular output file is handed over to be filled in place, for
+    // anything else (a pipe, a terminal) the daemon returns a memfd
+    struct stat info;
+    bool existed = stat(outputFileName.c_str(), &info) == 0;
+    fds[1] = open(outputFileName.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    bool inPlace = fds[1] >= 0 && fstat(fds[1], &info) == 0 && S_ISREG(info.st_mode);
+    request.kind = REQUEST_FD;
+    request.nameLength = (uint32_t)inputFileName.size();
+    request.payloadLength = 0;
+    int returned = -1, count = 0;
+    ok = writeWithFds(fd, &request, sizeof(request), fds, inPlace ? 2 : 1) &&
+         writeAll(fd, inputFileName.data(), inputFileName.size()) &&
+         readWithFds(fd, &response, sizeof(response), &returned, 1, count);
+    if (ok)
+    {
+        result.ok = response.ok != 0;
+        result.text.clear();
+        result.diagnostics.resize(response.diagnosticsLength);
+        ok = readAll(fd, &result.diagnostics[0], result.diagnostics.size());
+    }
+    if (ok && result.ok && !inPlace)
+    {
+        // copy the daemon's memfd to the output
+        size_t size = response.textLength;
+        void *map = size ? mmap(nullptr, size, PROT_READ, MAP_PRIVATE, returned, 0) : nullptr;
+        result.ok = count == 1 && (size == 0 || map != MAP_FAILED) && fds[1] >= 0 &&
+                    writeAll(fds[1], map, size);
+        if (size && map != MAP_FAILED)
+            munmap(map, size);
+        if (!result.ok)
+            result.diagnostics += outputFileName + ": error: cannot write file\n";
+    }
+    if (count == 1)
+        close(returned);
+    close(fds[0]);
+    if (fds[1] >= 0)
+        close(fds[1]);
+    if (!existed && !(ok && result.ok))
+        unlink(outputFileName.c_str());
+#else
+    // the daemon may run in another directory, send an absolute path
+    error_code ec;
+    string path = filesystem::absolute(inputFileName, ec).string();
+    request.kind = REQUEST_PATH;
+    request.nameLength = (uint32_t)path.size();
+    request.payloadLength = 0;
+    ok = writeAll(fd, &request, sizeof(request)) && writeAll(fd, path.data(), path.size()) &&
+         readAll(fd, &response, sizeof(response));
+    if (ok)
+    {
+        result.ok = response.ok != 0;
+        result.text.resize(response.textLength);
+        result.diagnostics.resize(response.diagnosticsLength);
+        ok = readAll(fd, &result.text[0], result.text.size()) &&
+             readAll(fd, &result.diagnostics[0], result.diagnostics.size());
+    }
+    if (ok && result.ok && !writeFile(outputFileName, result.text))
+    {
+        result.ok = false;
+        result.diagnostics += outputFileName + ": error: cannot write file\n";
+    }
+#endif
+    close(fd);
+    return ok;
+}
+
+#endif
+
+#ifdef __linux__
+
+// one source line as the watcher keeps it between edits
+struct WatchLine
+{
+    string text;   // the raw line
+    int type;      // A_INSTRUCTION, C_INSTRUCTION, L_INSTRUCTION or 0 for none
+    string symbol; // the label, or the symbol of an A instruction that needs the table
+    uint16_t word; // the encoded word when it does not depend on the table
+};
+
+// keeps the parsed lines, tables and rom of the last good build and
+// reassembles only what an edit touches: changed lines are re-lexed,
+// label addresses are recomputed only if the instruction layout moved,
+// variables only if references changed, and only the words that differ
+// are written back into the output file
+class Watcher
+{
+public:
+    Watcher(const string &input, const string &output)
+    {
+        inputFileName = input;
+        outputFileName = output;
+    }
+
+    int run()
+    {
+        string dir = filesystem::path(inputFileName).parent_path().string();
+        string base = filesystem::path(inputFileName).filename().string();
+        int fd = inotify_init1(IN_CLOEXEC);
+        // watch the directory, editors often save by renaming a new file over the old one
+        if (fd < 0 || inotify_add_watch(fd, dir.empty() ? "." : dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE) < 0)
+        {
+            cerr << inputFileName << ": error: cannot watch: " << strerror(errno) << endl;
+            return 1;
+        }
+        rebuild();
+        char buffer[1 << 16] __attribute__((aligned(__alignof__(inotify_event))));
+        for (;;)
+        {
+            ssize_t n = read(fd, buffer, sizeof(buffer));
+            if (n <= 0)
+            {
+                if (n < 0 && errno == EINTR)
+                    continue;
+                break;
+            }
+            bool touched = false;
+            for (char *p = buffer; p < buffer + n; p += sizeof(inotify_event) + ((inotify_event *)p)->len)
+            {
+                inotify_event *event = (inotify_event *)p;
+                touched = touched || (event->len > 0 && base == event->name);
+            }
+            if (!touched)
+                continue;
+            // let a burst of events from one save settle
+            pollfd settle = {fd, POLLIN, 0};
+            while (poll(&settle, 1, 20) > 0 && read(fd, buffer, sizeof(buffer)) > 0)
+                ;
+            update();
+        }
+        close(fd);
+        return 1;
+    }
+
+private:
+    string inputFileName;
+    string outputFileName;
+    bool built = false;
+    vector<WatchLine> lines;
+    vector<uint16_t> rom;
+    unordered_map<string, int> labels;
+    unordered_map<string, int> variables;
+
+    // a full build, on startup and until the first one succeeds
+    void rebuild()
+    {
+        auto start = chrono::steady_clock::now();
+        string source;
+        if (!readFile(inputFileName, source))
+        {
+            cerr << inputFileName << ": error: cannot open file" << endl;
+            return;
+        }
+        vector<string> text = splitLines(source);
+        vector<WatchLine> parsed(text.size());
+        string diagnostics;
+        bool ok = true;
+        for (size_t i = 0; i < text.size(); i++)
+            ok = lexLine(text[i], (uint32_t)i + 1, parsed[i], diagnostics) && ok;
+        cerr << diagnostics;
+        if (!ok)
+            return;
+        lines.swap(parsed);
+        layout();
+        allocate();
+        resolve(rom);
+        built = writeFile(outputFileName, hackText(rom));
+        report(start, rom.size(), rom.size());
+    }
+
+    void update()
+    {
+        if (!built)
+        {
+            rebuild();
+            return;
+        }
+        auto start = chrono::steady_clock::now();
+        string source;
+        if (!readFile(inputFileName, source))
+            return;
+        vector<string> text = splitLines(source);
+
+        // the edit is the region between the common prefix and suffix
+        size_t prefix = 0;
+        while (prefix < text.size() && prefix < lines.size() && text[prefix] == lines[prefix].text)
+            prefix++;
+        size_t suffix = 0;
+        while (suffix < text.size() - prefix && suffix < lines.size() - prefix &&
+               text[text.size() - 1 - suffix] == lines[lines.size() - 1 - suffix].text)
+            suffix++;
+        size_t oldEnd = lines.size() - suffix;
+        size_t newEnd = text.size() - suffix;
+        if (prefix == oldEnd && prefix == newEnd)
+            return; // nothing changed
+
+        vector<WatchLine> region(newEnd - prefix);
+        string diagnostics;
+        bool ok = true;
+        for (size_t i = prefix; i < newEnd; i++)
+            ok = lexLine(text[i], (uint32_t)i + 1, region[i - prefix], diagnostics) && ok;
+        cerr << diagnostics;
+        if (!ok)
+            return; // keep the last good build, the next edit is diffed against it
+
+        // which tables the edit can affect
+        bool moved = false, references = false;
+        size_t oldCount = 0, newCount = 0;
+        vector<pair<string, size_t>> oldLabels, newLabels;
+        vector<string> oldSymbols, newSymbols;
+        for (size_t i = prefix; i < oldEnd; i++)
+            summarize(lines[i], oldCount, oldLabels, oldSymbols);
+        for (const WatchLine &line : region)
+            summarize(line, newCount, newLabels, newSymbols);
+        moved = oldCount != newCount || oldLabels != newLabels;
+        references = oldSymbols != newSymbols;
+
+        size_t firstWord = 0;
+        for (size_t i = 0; i < prefix; i++)
+            firstWord += lines[i].type == A_INSTRUCTION || lines[i].type == C_INSTRUCTION;
+        lines.erase(lines.begin() + prefix, lines.begin() + oldEnd);
+        lines.insert(lines.begin() + prefix, region.begin(), region.end());
+
+        vector<uint16_t> next;
+        if (moved || references)
+        {
+            if (moved)
+                layout();
+            allocate();
+            resolve(next);
+        }
+        else
+        {
+            // same layout and tables: only the words of the region change
+            next = rom;
+            size_t word = firstWord;
+            for (const WatchLine &line : region)
+            {
+                if (line.type == A_INSTRUCTION || line.type == C_INSTRUCTION)
+                    next[word++] = encode(line);
+            }
+        }
+        size_t written = patch(next);
+        rom.swap(next);
+        report(start, written, rom.size());
+    }
+
+    static vector<string> splitLines(const string &source)
+    {
+        vector<string> text;
+        size_t begin = 0;
+        while (begin < source.size())
+        {
+            size_t end = source.find('\n', begin);
+            if (end == string::npos)
+                end = source.size();
+            text.push_back(source.substr(begin, end - begin));
+            begin = end + 1;
+        }
+        return text;
+    }
+
+    // lexes one line on its own, the same way the full assembler does
+    bool lexLine(const string &text, uint32_t number, WatchLine &line, string &diagnostics)
+    {
+        static const Code code;
+        line.text = text;
+        line.type = 0;
+        line.symbol.clear();
+        line.word = 0;
+        Parser parser(text.data(), text.size());
+        if (!parser.hasMoreLines())
+            return true;
+        parser.advance();
+        parser.lineNumber = number;
+        if (!checkLine(&parser, &code, inputFileName, diagnostics))
+            return false;
+        line.type = parser.instructionType();
+        if (line.type == L_INSTRUCTION)
+            line.symbol = parser.symbol();
+        else if (line.type == C_INSTRUCTION)
+            line.word = code.word(parser.dest(), parser.comp(), parser.jump());
+        else if (parser.numeric)
+            line.word = (uint16_t)parser.number;
+        else
+        {
+            int predefined = predefinedAddress(string_view(parser.line).substr(1));
+            if (predefined >= 0)
+                line.word = (uint16_t)predefined;
+            else
+                line.symbol = parser.symbol();
+        }
+        return true;
+    }
+
+    static void summarize(const WatchLine &line, size_t &count, vector<pair<string, size_t>> &labelsAt, vector<string> &symbols)
+    {
+        if (line.type == L_INSTRUCTION)
+            labelsAt.push_back(make_pair(line.symbol, count));
+        else if (line.type != 0)
+        {
+            count++;
+            if (!line.symbol.empty())
+                symbols.push_back(line.symbol);
+        }
+    }
+
+    // label addresses from the instruction layout, the first definition wins
+    void layout()
+    {
+        labels.clear();
+        int address = 0;
+        for (const WatchLine &line : lines)
+        {
+            if (line.type == L_INSTRUCTION)
+            {
+                if (predefinedAddress(line.symbol) < 0)
+                    labels.insert(make_pair(line.symbol, address));
+            }
+            else if (line.type != 0)
+                address++;
+        }
+    }
+
+    // variable addresses from 16 in order of first use
+    void allocate()
+    {
+        variables.clear();
+        int address = 16;
+        for (const WatchLine &line : lines)
+        {
+            if (line.type == A_INSTRUCTION && !line.symbol.empty() && !labels.count(line.symbol) &&
+                variables.insert(make_pair(line.symbol, address)).second)
+                address++;
+        }
+    }
+
+    uint16_t encode(const WatchLine &line)
+    {
+        if (line.symbol.empty())
+            return line.word;
+        auto label = labels.find(line.symbol);
+        int address = label != labels.end() ? label->second : variables[line.symbol];
+        return (uint16_t)(address & 0x7FFF);
+    }
+
+    void resolve(vector<uint16_t> &words)
+    {
+        words.clear();
+        for (const WatchLine &line : lines)
+        {
+            if (line.type == A_INSTRUCTION || line.type == C_INSTRUCTION)
+                words.push_back(encode(line));
+        }
+    }
+
+    // rewrites only the records that differ; records are 17 bytes so a
+    // word can be patched where it is. If the length changed everything
+    // from the first difference on is rewritten. Returns the words written.
+    size_t patch(const vector<uint16_t> &next)
+    {
+        int fd = open(outputFileName.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (fd < 0)
+        {
+            cerr << outputFileName << ": error: cannot write file" << endl;
+            return 0;
+        }
+        size_t written = 0;
+        char record[17];
+        vector<uint16_t> one(1);
+        if (next.size() == rom.size())
+        {
+            for (size_t i = 0; i < next.size(); i++)
+            {
+                if (next[i] == rom[i])
+                    continue;
+                one[0] = next[i];
+                formatHack(one, record);
+                if (pwrite(fd, record, 17, (off_t)i * 17) == 17)
+                    written++;
+            }
+        }
+        else
+        {
+            size_t first = 0;
+            while (first < next.size() && first < rom.size() && next[first] == rom[first])
+                first++;
+            vector<uint16_t> tail(next.begin() + first, next.end());
+            string text = hackText(tail);
+            if (pwrite(fd, text.data(), text.size(), (off_t)first * 17) == (ssize_t)text.size() &&
+                ftruncate(fd, (off_t)next.size() * 17) == 0)
+                written = tail.size();
+        }
+        close(fd);
+        return written;
+    }
+
+    void report(chrono::steady_clock::time_point start, size_t written, size_t total)
+    {
+        double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        cerr << outputFileName << ": " << written << " of " << total << " words written in " << ms << " ms" << endl;
+    }
+};
+
+#endif
+
+int main(int argc, char *argv[])
+{
+    vector<string> files;
+    Options options;
+    string cacheDir;
+    string daemonSocket;
+    string connectSocket = getenv("HACK_ASSEMBLER_SOCKET") ? getenv("HACK_ASSEMBLER_SOCKET") : "";
+    size_t threads = thread::hardware_concurrency();
+    uint64_t cacheSize = 256; // megabytes
+    bool cacheStats = false;
+    bool objectMode = false;
+    bool cMode = false;
+    bool analyzeMode = false;
+    bool linkMode = false;
+    bool watchMode = false;
+    string manifestFile;
+    bool runMode = false;
+    bool jitMode = false;
+    string profileFile;
+    string debugFile;
+    string stacksFile;
+    bool testMode = false;
+    string gradeDir;
+    string reportFile = "grades.json";
+    GradeLimits limits;
+    uint64_t maxCycles = DEFAULT_CYCLES;
+    vector<string> sets;
+    vector<string> prints;
+    string traceFile;
+    size_t traceSize = 1024; // kilobytes
+    vector<string> breaks;
+    string saveStateFile;
+    string loadStateFile;
+    for (int i = 1; i < argc; i++)
+    {
+        string arg = argv[i];
+        if (arg == "--bench")
+            return runBenchmarks(argc - i - 1, argv + i + 1);
+        else if (arg == "--batch" && i + 1 < argc)
+            options.batch = max(1, atoi(argv[++i]));
+        else if (arg == "--cache" && i + 1 < argc)
+            cacheDir = argv[++i];
+        else if (arg == "--cache-size" && i + 1 < argc)
+            cacheSize = strtoull(argv[++i], nullptr, 10);
+        else if (arg == "--cache-stats")
+            cacheStats = true;
+        else if (arg == "--daemon" && i + 1 < argc)
+            daemonSocket = argv[++i];
+        else if (arg == "--connect" && i + 1 < argc)
+            connectSocket = argv[++i];
+        else if (arg == "--threads" && i + 1 < argc)
+            threads = max(1, atoi(argv[++i]));
+        else if (arg == "--object")
+            objectMode = true;
+        else if (arg == "--emit-c")
+            cMode = true;
+        else if (arg == "--analyze")
+            analyzeMode = true;
+        else if (arg == "--link")
+            linkMode = true;
+        else if (arg == "--watch")
+            watchMode = true;
+        else if (arg == "--manifest" && i + 1 < argc)
+            manifestFile = argv[++i];
+        else if (arg == "--run")
+            runMode = true;
+        else if (arg == "--jit")
+            jitMode = true;
+        else if (arg == "--debug" && i + 1 < argc)
+            debugFile = argv[++i];
+        else if (arg == "--profile" && i + 1 < argc)
+            profileFile = argv[++i];
+        else if (arg == "--stacks" && i + 1 < argc)
+            stacksFile = argv[++i];
+        else if (arg == "--test")
+            testMode = true;
+        else if (arg == "--grade" && i + 1 < argc)
+            gradeDir = argv[++i];
+        else if (arg == "--report" && i + 1 < argc)
+            reportFile = argv[++i];
+        else if (arg == "--time-limit" && i + 1 < argc)
+            limits.seconds = atof(argv[++i]);
+        else if (arg == "--size-limit" && i + 1 < argc)
+            limits.bytes = strtoull(argv[++i], nullptr, 10) << 10;
+        else if (arg == "--cycles" && i + 1 < argc)
+            maxCycles = strtoull(argv[++i], nullptr, 10);
+        else if (arg == "--set" && i + 1 < argc)
+            sets.push_back(argv[++i]);
+        else if (arg == "--print" && i + 1 < argc)
+            prints.push_back(argv[++i]);
+        else if (arg == "--trace" && i + 1 < argc)
+            traceFile = argv[++i];
+        else if (arg == "--trace-size" && i + 1 < argc)
+            traceSize = strtoull(argv[++i], nullptr, 10);
+        else if (arg == "--break" && i + 1 < argc)
+            breaks.push_back(argv[++i]);
+        else if (arg == "--save-state" && i + 1 < argc)
+            saveStateFile = argv[++i];
+        else if (arg == "--load-state" && i + 1 < argc)
+            loadStateFile = argv[++i];
+        else
+            files.push_back(arg);
+    }
+#ifdef HAVE_UNIX_SOCKETS
+    if (!daemonSocket.empty())
+    {
+        Daemon daemon(options, threads, cacheSize << 20);
+        return daemon.run(daemonSocket);
+    }
+#endif
+    if (linkMode)
+    {
+        if (files.size() < 2)
+        {
+            cerr << "usage: HackAssembler --link module.hobj... output.hack" << endl;
+            return 1;
+        }
+        string outputFileName = files.back();
+        files.pop_back();
+        vector<MappedObject *> modules;
+        string diagnostics;
+        bool ok = true;
+        for (size_t i = 0; i < files.size(); i++)
+        {
+            modules.push_back(new MappedObject());
+            ok = modules.back()->open(files[i], diagnostics) && ok;
+        }
+        vector<uint16_t> rom;
+        ThreadPool pool(threads);
+        ok = ok && link(modules, pool, rom, diagnostics);
+        for (MappedObject *module : modules)
+            delete module;
+        cerr << diagnostics;
+        if (ok && !writeFile(outputFileName, hackText(rom)))
+        {
+            cerr << outputFileName << ": error: cannot write file" << endl;
+            ok = false;
+        }
+        return ok ? 0 : 1;
+    }
+    if (!manifestFile.empty())
+    {
+        BuildManifest manifest(manifestFile);
+        ThreadPool pool(threads);
+        return manifest.build(files, pool) ? 0 : 1;
+    }
+    if (!gradeDir.empty())
+    {
+        if (files.empty())
+        {
+            cerr << "usage: HackAssembler --grade DIR [--report FILE] [--threads N] [--cycles N] [--time-limit SECONDS] [--size-limit KB] script.tst..." << endl;
+            return 1;
+        }
+        limits.cycles = maxCycles;
+        ThreadPool pool(threads);
+        return gradeSubmissions(gradeDir, files, limits, options, pool, reportFile) ? 0 : 1;
+    }
+    if (analyzeMode)
+    {
+        vector<uint16_t> rom;
+        string diagnostics;
+        DebugInfo debug;
+        bool ok = files.size() == 1 && loadProgram(files[0], options, rom, diagnostics, &debug);
+        if (ok && !debugFile.empty() && filesystem::path(files[0]).extension() == ".hack")
+            ok = readDebugInfo(debugFile, debug, diagnostics);
+        cerr << diagnostics;
+        if (!ok)
+        {
+            if (files.size() != 1)
+                cerr << "usage: HackAssembler --analyze program.asm|program.hack [--debug FILE]" << endl;
+            return 1;
+        }
+        char row[64];
+        cout << "instructions  loops  depth        best       worst  routine\n";
+        for (const RoutineCost &cost : analyzeProgram(rom, debug))
+        {
+            snprintf(row, sizeof(row), "%12u %6u %6u %11llu %11llu  ", cost.instructions, cost.loops, cost.depth,
+                     (unsigned long long)cost.best, (unsigned long long)cost.worst);
+            cout << row << cost.name << " (" << cost.address << ")\n";
+        }
+        cout << flush;
+        return 0;
+    }
+    if (testMode)
+    {
+        // every script starts from the same state, read once
+        MachineState saved;
+        string diagnostics;
+        if (!loadStateFile.empty() && !readState(loadStateFile, saved, diagnostics))
+        {
+            cerr << diagnostics;
+            return 1;
+        }
+        ThreadPool pool(threads);
+        vector<string> reports(files.size());
+        vector<char> passed(files.size(), 0);
+        pool.parallelFor(files.size(), [&](size_t i) {
+            auto start = chrono::steady_clock::now();
+            TestScript script(files[i], options, maxCycles);
+            if (!loadStateFile.empty())
+                script.state = &saved;
+            string message;
+            passed[i] = script.run(message);
+            double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+            reports[i] = files[i] + ": " + (passed[i] ? "passed" : "failed, " + message) + " (" +
+                         to_string(script.cycles) + " cycles, " + to_string(ms) + " ms)";
+        });
+        size_t count = 0;
+        for (size_t i = 0; i < files.size(); i++)
+        {
+            cout << reports[i] << "\n";
+            count += passed[i];
+        }
+        cout << flush;
+        cerr << count << " of " << files.size() << " tests passed" << endl;
+        return count == files.size() ? 0 : 1;
+    }
+    if (runMode)
+    {
+        vector<uint16_t> rom;
+        string diagnostics;
+        DebugInfo debug;
+        bool ok = files.size() == 1 && loadProgram(files[0], options, rom, diagnostics, &debug);
+        if (ok && !debugFile.empty() && filesystem::path(files[0]).extension() == ".hack")
+            ok = readDebugInfo(debugFile, debug, diagnostics);
+        cerr << diagnostics;
+        if (!ok)
+        {
+            if (files.size() != 1)
+                cerr << "usage: HackAssembler --run program.asm|program.hack [--jit] [--debug FILE] [--profile FILE] [--stacks FILE] [--trace FILE [--trace-size KB] [--break ADDR|LABEL]...] [--load-state FILE] [--save-state FILE] [--cycles N] [--set ADDR=VALUE]... [--print ADDR[-ADDR]]..." << endl;
+            return 1;
+        }
+        Emulator emulator;
+        emulator.load(rom);
+        MachineState saved;
+        if (!loadStateFile.empty())
+        {
+            if (!readState(loadStateFile, saved, diagnostics))
+            {
+                cerr << diagnostics;
+                return 1;
+            }
+            if (!emulator.restore(saved))
+            {
+                cerr << loadStateFile << ": error: the saved state is of another program" << endl;
+                return 1;
+            }
+        }
+        for (const string &set : sets)
+        {
+            size_t eq = set.find('=');
+            int address = ramAddress(set.substr(0, eq));
+            if (eq == string::npos || address < 0)
+            {
+                cerr << "--set " << set << ": error: expected ADDR=VALUE" << endl;
+                return 1;
+            }
+            emulator.poke(address, (uint16_t)atoi(set.c_str() + eq + 1));
+        }
+        bool profiling = !profileFile.empty() || !stacksFile.empty();
+        bool tracing = !traceFile.empty();
+        if ((profiling && tracing) || (!breaks.empty() && !tracing))
+        {
+            cerr << "error: --trace cannot be combined with --profile or --stacks, and --break needs --trace" << endl;
+            return 1;
+        }
+        const char *engine = "interpreter";
+        string state;
+        auto start = chrono::steady_clock::now();
+        uint64_t executed;
+        CycleProfile profile;
+        TraceBuffer trace(tracing ? traceSize << 10 : 0);
+        bool written = true;
+        if (profiling)
+            executed = emulator.run(maxCycles, profile);
+        else if (tracing)
+        {
+            for (const string &at : breaks)
+            {
+                auto label = find_if(debug.labels.begin(), debug.labels.end(),
+                                     [&](const pair<string, int> &l) { return l.first == at; });
+                char *end;
+                long address = label != debug.labels.end() ? label->second : strtol(at.c_str(), &end, 10);
+                if ((label == debug.labels.end() && (at.empty() || *end)) || address < 0 || address >= ROM_SIZE)
+                {
+                    cerr << "--break " << at << ": error: expected a ROM address or a label" << endl;
+                    return 1;
+                }
+                trace.breakpoints[address] = 1;
+            }
+            // SIGINT and SIGTERM stop the run, SIGUSR1 dumps the trace so far
+            traceSignal = 0;
+            signal(SIGINT, onTraceSignal);
+            signal(SIGTERM, onTraceSignal);
+#ifdef SIGUSR1
+            signal(SIGUSR1, onTraceSignal);
+#endif
+            engine = "interpreter, traced";
+            executed = 0;
+            int stopSignal = 0;
+            while (written && !emulator.halted && !trace.stoppedAtBreakpoint && !stopSignal && executed < maxCycles)
+            {
+                executed += emulator.run(min((uint64_t)TRACE_SLICE, maxCycles - executed), trace);
+                int number = traceSignal;
+                traceSignal = 0;
+#ifdef SIGUSR1
+                if (number == SIGUSR1)
+                {
+                    written = writeFile(traceFile, trace.dump(debug, emulator.cycles));
+                    continue;
+                }
+#endif
+                stopSignal = number;
+            }
+            signal(SIGINT, SIG_DFL);
+            signal(SIGTERM, SIG_DFL);
+#ifdef SIGUSR1
+            signal(SIGUSR1, SIG_DFL);
+#endif
+            if (trace.stoppedAtBreakpoint)
+                state = "stopped at breakpoint " + to_string(emulator.pc);
+            else if (stopSignal)
+                state = "stopped by signal " + to_string(stopSignal);
+        }
+#ifdef HAVE_X86_64_JIT
+        else if (jitMode)
+        {
+            Jit jit(emulator);
+            engine = jit.available() ? "jit" : "interpreter, no executable memory for the jit";
+            executed = jit.run(maxCycles);
+        }
+#endif
+        else
+            executed = emulator.run(maxCycles);
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        if (tracing && (!written || !writeFile(traceFile, trace.dump(debug, emulator.cycles))))
+        {
+            cerr << traceFile << ": error: cannot write file" << endl;
+            return 1;
+        }
+        if (profiling)
+        {
+            string flat, stacks;
+            string name = debug.source.empty() ? files[0] : debug.source;
+            writeProfile(profile, debug, filesystem::path(name).filename().string(), flat, stacks);
+            if ((!profileFile.empty() && !writeFile(profileFile, flat)) || (!stacksFile.empty() && !writeFile(stacksFile, stacks)))
+            {
+                cerr << "error: cannot write the profile" << endl;
+                return 1;
+            }
+        }
+        for (const string &print : prints)
+        {
+            size_t dash = print.find('-');
+            int from = ramAddress(print.substr(0, dash));
+            int to = dash == string::npos ? from : ramAddress(print.substr(dash + 1));
+            if (from < 0 || to < from)
+            {
+                cerr << "--print " << print << ": error: expected ADDR or ADDR-ADDR" << endl;
+                return 1;
+            }
+            for (int i = from; i <= to; i++)
+                cout << "RAM[" << i << "] = " << (int16_t)emulator.ram[i] << "\n";
+        }
+        cout << flush;
+        if (!saveStateFile.empty())
+        {
+            emulator.save(saved);
+            if (!writeState(saveStateFile, saved))
+            {
+                cerr << saveStateFile << ": error: cannot write file" << endl;
+                return 1;
+            }
+        }
+        if (state.empty())
+            state = emulator.halted ? "halted" : "stopped";
+        cerr << files[0] << ": " << state << " after " << executed << " cycles in "
+             << seconds * 1000 << " ms (" << (seconds > 0 ? executed / seconds / 1e6 : 0) << " MIPS, " << engine << ")" << endl;
+        return 0;
+    }
+    AssemblyCache *cache = nullptr;
+    if (!cacheDir.empty())
+        cache = new AssemblyCache(cacheDir, cacheSize << 20);
+    if (cacheStats && cache && files.empty())
+    {
+        cache->printStats(cout);
+        delete cache;
+        return 0;
+    }
+    if (files.size() != 2)
+    {
+        cerr << "usage: HackAssembler [--batch N] [--cache DIR [--cache-size MB] [--cache-stats]] [--connect SOCKET] [--debug FILE] input.asm output.hack" << endl;
+        cerr << "       HackAssembler --bench [NAME...]" << endl;
+        cerr << "       HackAssembler --watch input.asm output.hack" << endl;
+        cerr << "       HackAssembler --object input.asm output.hobj" << endl;
+        cerr << "       HackAssembler --emit-c input.asm|input.hack output.c" << endl;
+        cerr << "       HackAssembler --link module.hobj... output.hack" << endl;
+        cerr << "       HackAssembler --manifest FILE [--threads N] input.asm..." << endl;
+        cerr << "       HackAssembler --test [--threads N] [--cycles N] [--load-state FILE] script.tst..." << endl;
+        cerr << "       HackAssembler --grade DIR [--report FILE] script.tst..." << endl;
+        cerr << "       HackAssembler --analyze program.asm|program.hack [--debug FILE]" << endl;
+        cerr << "       HackAssembler --run program.asm|program.hack [--jit] [--debug FILE] [--profile FILE] [--stacks FILE] [--trace FILE [--trace-size KB] [--break ADDR|LABEL]...] [--load-state FILE] [--save-state FILE] [--cycles N] [--set ADDR=VALUE]... [--print ADDR[-ADDR]]..." << endl;
+        cerr << "       HackAssembler --daemon SOCKET [--threads N] [--cache-size MB]" << endl;
+        return 1;
+    }
+    string inputFileName = files[0];  // input file name
+    string outputFileName = files[1]; // output file name
+
+#ifdef __linux__
+    if (watchMode)
+    {
+        Watcher watcher(inputFileName, outputFileName);
+        delete cache;
+        return watcher.run();
+    }
+#else
+    if (watchMode)
+    {
+        cerr << "--watch: error: unsupported on this platform" << endl;
+        delete cache;
+        return 1;
+    }
+#endif
+
+    if (cMode)
+    {
+        vector<uint16_t> rom;
+        string diagnostics;
+        bool ok = loadProgram(inputFileName, options, rom, diagnostics);
+        cerr << diagnostics;
+        if (ok && !writeFile(outputFileName, transpileC(rom, inputFileName)))
+        {
+            cerr << outputFileName << ": error: cannot write file" << endl;
+            ok = false;
+        }
+        delete cache;
+        return ok ? 0 : 1;
+    }
+
+    if (objectMode)
+    {
+        string source;
+        ObjectModule module;
+        string diagnostics;
+        bool ok = readFile(inputFileName, source);
+        if (!ok)
+            diagnostics = inputFileName + ": error: cannot open file\n";
+        ok = ok && assembleObject(source, inputFileName, module, diagnostics);
+        cerr << diagnostics;
+        if (ok && !writeObject(outputFileName, module))
+        {
+            cerr << outputFileName << ": error: cannot write file" << endl;
+            ok = false;
+        }
+        delete cache;
+        return ok ? 0 : 1;
+    }
+
+#ifdef HAVE_UNIX_SOCKETS
+    // hand the file to a warm daemon when one is listening
+    AssemblyResult remote;
+    if (!connectSocket.empty() && debugFile.empty() && assembleRemote(connectSocket, inputFileName, outputFileName, remote))
+    {
+        cerr << remote.diagnostics;
+        delete cache;
+        return remote.ok ? 0 : 1;
+    }
+#endif
+
+    string source;
+    if (!readFile(inputFileName, source))
+    {
+        cerr << inputFileName << ": error: cannot open file" << endl;
+        return 1;
+    }
+    string key;
+    if (cache)
+    {
+        key = cache->key(source);
+        if (debugFile.empty() && cache->fetch(key, source, outputFileName))
+        {
+            if (cacheStats)
+                cache->printStats(cerr);
+            delete cache;
+            return 0;
+        }
+    }
+    vector<uint16_t> rom;
+    string diagnostics;
+    DebugInfo debug;
+    bool ok = assemble(source, inputFileName, options, rom, diagnostics, debugFile.empty() ? nullptr : &debug);
+    cerr << diagnostics;
+    string text;
+    if (ok)
+    {
+        text = hackText(rom);
+        ok = writeFile(outputFileName, text);
+        if (!ok)
+            cerr << outputFileName << ": error: cannot write file" << endl;
+    }
+    if (ok && !debugFile.empty() && !writeDebugInfo(debugFile, debug))
+    {
+        cerr << debugFile << ": error: cannot write file" << endl;
+        ok = false;
+    }
+    if (ok && cache)
+        cache->store(key, source, text);
+    if (cacheStats && cache)
+        cache->printStats(cerr);
+    delete cache;
+    return ok ? 0 : 1;
+}
+
+// benchmarks
+// --bench generates each benchmark's inputs, times the assembler on them and
+// checks the results; a result that is wrong or slower than its limit fails
+// the run, so the suite also guards the worst cases against regressions
+
+// seconds elapsed since start
+static double secondsSince(chrono::steady_clock::time_point start)
+{
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+// writes content to a scratch file for a benchmark and returns its name
+static string benchFile(const string &name, const string &content)
+{
+    string fileName = (filesystem::temp_directory_path() / ("hack-bench-" + name)).string();
+    ofstream file(fileName, ios::binary);
+    file << content;
+    return fileName;
+}
+
+// prints one timed row and returns whether it was correct and within its limit
+static bool benchRow(const string &what, const string &measure, double seconds, double limit, bool correct)
+{
+    char row[200];
+    snprintf(row, sizeof(row), "  %-28s %-26s %10.2f ms  (limit %.0f ms)  %s",
+             what.c_str(), measure.c_str(), seconds * 1e3, limit * 1e3,
+             !correct ? "WRONG" : seconds > limit ? "TOO SLOW" : "ok");
+    cout << row << endl;
+    return correct && seconds <= limit;
+}
+
+// a row for a pass over bytes of input, with its throughput
+static bool benchReport(const string &what, size_t bytes, double seconds, double limit, bool correct)
+{
+    char measure[64];
+    snprintf(measure, sizeof(measure), "%8.1f MB %7.2f GB/s", bytes / 1e6, bytes / max(seconds, 1e-9) / 1e9);
+    return benchRow(what, measure, seconds, limit, correct);
+}
+
+// strips every line of the file the way each pass of the assembler does and
+// returns the lines that are left
+static vector<string> stripLines(const string &fileName)
+{
+    vector<string> lines;
+    string source;
+    readFile(fileName, source);
+    Parser parser(source.data(), source.size());
+    while (parser.hasMoreLines())
+    {
+        parser.advance();
+        if (!parser.line.empty())
+            lines.push_back(parser.line);
+    }
+    return lines;
+}
+
+// adversarial lines for whitespace and comment stripping; the limit allows
+// 50 ns per byte, far above a linear pass and far below a quadratic one
+static bool benchStrip()
+{
+    struct Case
+    {
+        string name;
+        string source;
+        vector<string> expected;
+    };
+    vector<Case> cases;
+    string symbol(1 << 20, 'x');
+    cases.push_back({"1 MB symbol", "@" + symbol + "\n", {"@" + symbol}});
+    string blanks;
+    for (int i = 0; i < (4 << 20); i++)
+        blanks += i % 3 ? ' ' : '\t';
+    cases.push_back({"8 MB of whitespace", blanks + "D=A" + blanks + "\r\n", {"D=A"}});
+    cases.push_back({"8 MB comment", "D=M // " + string(8 << 20, '/') + "\n", {"D=M"}});
+    string slashes;
+    for (int i = 0; i < (1 << 19); i++)
+        slashes += "/ ";
+    cases.push_back({"1 MB of lone slashes", slashes + "\n", {string(1 << 19, '/')}});
+    string mixed;
+    vector<string> mixedLines;
+    for (int i = 0; i < 200000; i++)
+    {
+        mixed += "\t @" + to_string(i) + " \t// load\r\n \tAM = M+1 ; JGT\t\r\n";
+        mixedLines.push_back("@" + to_string(i));
+        mixedLines.push_back("AM=M+1;JGT");
+    }
+    cases.push_back({"CRLF, tabs and comments", mixed, mixedLines});
+    string comments;
+    for (int i = 0; i < (1 << 20); i++)
+        comments += "  // // //\n";
+    cases.push_back({"1M comment lines", comments, {}});
+    cases.push_back({"8M blank lines", string(8 << 20, '\n'), {}});
+
+    bool passed = true;
+    for (const Case &c : cases)
+    {
+        string fileName = benchFile("strip.asm", c.source);
+        auto start = chrono::steady_clock::now();
+        vector<string> lines = stripLines(fileName);
+        double seconds = secondsSince(start);
+        remove(fileName.c_str());
+        passed = benchReport(c.name, c.source.size(), seconds, 0.1 + c.source.size() * 50e-9, lines == c.expected) && passed;
+    }
+    return passed;
+}
+
+// the line-at-a-time loop the scanner replaced, the baseline it is measured against
+static vector<string> getlineLines(const string &source)
+{
+    vector<string> lines;
+    istringstream input(source);
+    string line;
+    while (getline(input, line))
+    {
+        trim(line);
+        if (!line.empty())
+            lines.push_back(line);
+    }
+    return lines;
+}
+
+// the stripped lines a scan produced
+static vector<string> spanLines(const string &source, const vector<LineSpan> &spans)
+{
+    vector<string> lines;
+    for (const LineSpan &l : spans)
+    {
+        string line = source.substr(l.begin, l.end - l.begin);
+        if (!l.compact)
+            trim(line);
+        lines.push_back(line);
+    }
+    return lines;
+}
+
+// line splitting throughput of each classifier the cpu supports, against the
+// getline loop, on 32 MB of commented source and 16 MB of short dense lines;
+// the limit of 100 ns per byte only catches a scan that is no longer linear
+static bool benchScan()
+{
+    string commented, dense;
+    for (int i = 0; commented.size() < (32 << 20); i++)
+    {
+        commented += "// routine " + to_string(i) + ", the comment line is long enough to span a block\r\n";
+        commented += "(LOOP" + to_string(i) + ")\r\n";
+        commented += "    @counter" + to_string(i % 97) + "\r\n";
+        commented += "    D=M // load it\r\n";
+        commented += "\r\n";
+        commented += "    AM = M+1 ; JGT\r\n";
+        commented += "\t@LOOP" + to_string(i) + "\r\n";
+        commented += "\t0;JMP\r\n";
+    }
+    for (int i = 0; dense.size() < (16 << 20); i++)
+        dense += i % 2 ? "D=D+A\n" : "@" + to_string(i % 32768) + "\n";
+
+    struct Variant
+    {
+        const char *name;
+        Scanner::Classifier classify;
+        bool supported;
+    };
+    vector<Variant> variants = {{"scalar", classifyScalar, true}};
+#ifdef HAVE_X86_SIMD
+    variants.push_back({"SSE2", classifySSE2, (bool)__builtin_cpu_supports("sse2")});
+    variants.push_back({"AVX2", classifyAVX2, (bool)__builtin_cpu_supports("avx2")});
+#endif
+    bool passed = true;
+    for (const string *source : {&commented, &dense})
+    {
+        string kind = source == &commented ? "commented" : "dense";
+        double limit = 0.1 + source->size() * 100e-9;
+        auto start = chrono::steady_clock::now();
+        vector<string> expected = getlineLines(*source);
+        passed = benchReport(kind + ", getline and trim", source->size(), secondsSince(start), limit, true) && passed;
+        for (const Variant &v : variants)
+        {
+            if (!v.supported)
+            {
+                cout << "  " << kind << ", " << v.name << ": not supported by this cpu" << endl;
+                continue;
+            }
+            Scanner scanner;
+            scanner.classify = v.classify;
+            vector<LineSpan> spans;
+            start = chrono::steady_clock::now();
+            scanner.scan(source->data(), source->size(), spans);
+            double seconds = secondsSince(start);
+            passed = benchReport(kind + ", " + v.name, source->size(), seconds, limit, spanLines(*source, spans) == expected) && passed;
+        }
+    }
+    return passed;
+}
+
+// freezing 10^4 to 10^6 symbols and looking each of them up four times, in a
+// scattered order, frozen and in the unordered_map; the limits allow 2 us
+// per symbol frozen and 1 us per lookup
+static bool benchFreeze()
+{
+    bool passed = true;
+    for (size_t n : {10000, 100000, 1000000})
+    {
+        SymbolTable table;
+        table.symbolMap.clear();
+        vector<string> names(n);
+        for (size_t i = 0; i < n; i++)
+        {
+            names[i] = (i % 3 ? "LOOP_" : "var.") + to_string(i * 7919 % 1000003);
+            table.addEntry(names[i], (int)(i & 0x7FFF));
+        }
+        vector<uint32_t> order(4 * n);
+        for (size_t i = 0; i < order.size(); i++)
+            order[i] = (uint32_t)(i * 2654435761u % n);
+        unordered_map<string, int> map = table.symbolMap;
+        string count = to_string(n) + " symbols";
+
+        auto start = chrono::steady_clock::now();
+        bool frozen = table.freeze();
+        passed = benchRow("freeze", count, secondsSince(start), 0.01 + n * 2e-6, frozen) && passed;
+
+        bool correct = true;
+        start = chrono::steady_clock::now();
+        for (uint32_t i : order)
+            correct &= table.getAddress(names[i]) == (int)(i & 0x7FFF);
+        double seconds = secondsSince(start);
+        char measure[64];
+        snprintf(measure, sizeof(measure), "%s, %.0f ns each", count.c_str(), seconds / order.size() * 1e9);
+        passed = benchRow("frozen lookups", measure, seconds, 0.01 + order.size() * 1e-6, correct) && passed;
+
+        correct = true;
+        start = chrono::steady_clock::now();
+        for (uint32_t i : order)
+            correct &= map.find(names[i])->second == (int)(i & 0x7FFF);
+        seconds = secondsSince(start);
+        snprintf(measure, sizeof(measure), "%s, %.0f ns each", count.c_str(), seconds / order.size() * 1e9);
+        passed = benchRow("unordered_map lookups", measure, seconds, 0.01 + order.size() * 1e-6, correct) && passed;
+    }
+    return passed;
+}
+
+// passes 2 and 3 over a program of 500k random constants, encoding them
+// directly and, as before, through the symbol table; the limit allows 1 us
+// per line
+static bool benchConstants()
+{
+    string source;
+    uint32_t random = 12345;
+    for (int i = 0; i < 500000; i++)
+    {
+        random = random * 1103515245 + 12345;
+        source += "@" + to_string(random >> 17) + "\nD=D+A\n";
+    }
+    Parser parser(source.data(), source.size());
+    double limit = 0.1 + parser.lines.size() * 1e-6;
+
+    // skipped in pass 2 and encoded from Parser::number in pass 3
+    auto start = chrono::steady_clock::now();
+    SymbolTable empty;
+    while (parser.hasMoreLines())
+    {
+        parser.advance();
+        if (parser.instructionType() == A_INSTRUCTION && !parser.numeric && !empty.contains(parser.symbol()))
+            empty.addEntry(parser.symbol(), 16);
+    }
+    empty.freeze();
+    vector<int> direct;
+    parser.reset();
+    while (parser.hasMoreLines())
+    {
+        parser.advance();
+        if (parser.instructionType() == A_INSTRUCTION)
+            direct.push_back(parser.numeric ? parser.number : -1);
+    }
+    double seconds = secondsSince(start);
+    string entries = to_string(empty.symbolMap.size()) + " table entries";
+    bool passed = benchRow("encoded directly", entries, seconds, limit, empty.symbolMap.empty());
+
+    // entered in pass 2, frozen and looked up in pass 3
+    start = chrono::steady_clock::now();
+    SymbolTable table;
+    parser.reset();
+    while (parser.hasMoreLines())
+    {
+        parser.advance();
+        if (parser.instructionType() == A_INSTRUCTION && !table.contains(parser.symbol()))
+            table.addEntry(parser.symbol(), parser.number);
+    }
+    table.freeze();
+    vector<int> looked;
+    parser.reset();
+    while (parser.hasMoreLines())
+    {
+        parser.advance();
+        if (parser.instructionType() == A_INSTRUCTION)
+            looked.push_back(table.getAddress(parser.symbol()));
+    }
+    seconds = secondsSince(start);
+    entries = to_string(table.symbolMap.size()) + " table entries";
+    return benchRow("through the symbol table", entries, seconds, limit, looked == direct) && passed;
+}
+
+// counts the last level cache misses of this thread between start() and
+// stop(), where the kernel and the cpu allow it (most virtual machines do not)
+class MissCounter
+{
+public:
+    int fd;
+
+    MissCounter()
+    {
+        fd = -1;
+#ifdef __linux__
+        perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HW_CACHE;
+        attr.config = PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+#endif
+    }
+    ~MissCounter()
+    {
+#ifdef __linux__
+        if (fd >= 0)
+            close(fd);
+#endif
+    }
+
+    void start()
+    {
+#ifdef __linux__
+        if (fd >= 0)
+        {
+            ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+            ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+#endif
+    }
+
+    // the misses since start(), "n/a" if they cannot be counted
+    string stop()
+    {
+#ifdef __linux__
+        long long misses;
+        if (fd >= 0 && ioctl(fd, PERF_EVENT_IOC_DISABLE, 0) == 0 && read(fd, &misses, sizeof(misses)) == sizeof(misses))
+            return to_string(misses);
+#endif
+        return "n/a";
+    }
+};
+
+// resolving 4M references into frozen tables of 10^4 and 10^6 symbols with
+// several batch sizes, with the last level cache misses of each run; the
+// limit allows 200 ns per reference
+static bool benchBatch()
+{
+    bool passed = true;
+    for (size_t n : {10000, 1000000})
+    {
+        SymbolTable table;
+        vector<string> names(n);
+        for (size_t i = 0; i < n; i++)
+        {
+            names[i] = "symbol." + to_string(i);
+            table.addEntry(names[i], (int)(i & 0x7FFF));
+        }
+        table.freeze();
+        vector<SymbolRef> refs(4 << 20);
+        vector<uint16_t> expected(refs.size());
+        uint32_t random = 12345;
+        for (size_t i = 0; i < refs.size(); i++)
+        {
+            random = random * 1103515245 + 12345;
+            size_t k = (random >> 8) % n;
+            refs[i].hash = hashSymbol(names[k].data(), names[k].size());
+            refs[i].index = (uint32_t)i;
+            expected[i] = (uint16_t)(k & 0x7FFF);
+        }
+        for (size_t batch : {1, 4, 8, 32, 64})
+        {
+            vector<uint16_t> rom(refs.size());
+            MissCounter misses;
+            misses.start();
+            auto start = chrono::steady_clock::now();
+            table.resolve(refs, rom, batch);
+            double seconds = secondsSince(start);
+            string llc = misses.stop();
+            char what[64], measure[96];
+            snprintf(what, sizeof(what), "%zu symbols, batch %zu", n, batch);
+            snprintf(measure, sizeof(measure), "%5.1f ns/ref, %s LLC misses", seconds / refs.size() * 1e9, llc.c_str());
+            passed = benchRow(what, measure, seconds, 0.1 + refs.size() * 200e-9, rom == expected) && passed;
+        }
+    }
+    return passed;
+}
+
+#if defined(HAVE_UNIX_SOCKETS) && defined(__linux__)
+// a memfd holding size bytes of source in 1 KB lines, one instruction and a
+// long comment each, so even 1 GB stays at a million instructions
+static int benchSource(size_t size)
+{
+    string line = "D=D+A // " + string(1014, '-') + "\n";
+    string chunk;
+    while (chunk.size() < (1 << 20))
+        chunk += line;
+    int fd = memfd_create("bench.asm", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    for (size_t done = 0; fd >= 0 && done < size; done += min(chunk.size(), size - done))
+    {
+        if (pwrite(fd, chunk.data(), min(chunk.size(), size - done), (off_t)done) < 0)
+        {
+            close(fd);
+            return -1;
+        }
+    }
+    return fd;
+}
+
+// sends source inline, the way a client without descriptor passing would
+static bool benchSendSource(const string &socketPath, const string &source, AssemblyResult &result)
+{
+    int fd = connectDaemon(socketPath);
+    if (fd < 0)
+        return false;
+    RequestHeader request;
+    request.kind = REQUEST_SOURCE;
+    request.nameLength = 9;
+    request.payloadLength = source.size();
+    ResponseHeader response;
+    bool ok = writeAll(fd, &request, sizeof(request)) && writeAll(fd, "bench.asm", 9) &&
+              writeAll(fd, source.data(), source.size()) && readAll(fd, &response, sizeof(response));
+    if (ok)
+    {
+        result.ok = response.ok != 0;
+        result.text.resize(response.textLength);
+        result.diagnostics.resize(response.diagnosticsLength);
+        ok = readAll(fd, &result.text[0], result.text.size()) &&
+             readAll(fd, &result.diagnostics[0], result.diagnostics.size());
+    }
+    close(fd);
+    return ok;
+}
+
+// daemon round trips for 1 KB to 1 GB of source: bytes through the socket,
+// the source as a plain descriptor (read with pread) and as a sealed memfd
+// (mapped), both answered into an output memfd; the limit allows 20 ns per
+// byte. The daemon runs in a child process on a scratch socket.
+static bool benchDaemon()
+{
+    string socketPath = (filesystem::temp_directory_path() / "hack-bench.sock").string();
+    pid_t child = fork();
+    if (child == 0)
+    {
+        if (!freopen("/dev/null", "w", stderr))
+            _exit(1);
+        Daemon daemon(Options(), 2, 0); // no result cache, every request assembles
+        _exit(daemon.run(socketPath));
+    }
+    int probe = -1;
+    for (int i = 0; i < 500 && probe < 0; i++)
+    {
+        this_thread::sleep_for(chrono::milliseconds(10));
+        probe = connectDaemon(socketPath);
+    }
+    if (probe < 0)
+    {
+        cout << "  the daemon did not start" << endl;
+        kill(child, SIGKILL);
+        waitpid(child, nullptr, 0);
+        return false;
+    }
+    close(probe);
+
+    const string word = "1110000010010000\n"; // D=D+A
+    bool passed = true;
+    for (size_t size : {(size_t)1 << 10, (size_t)1 << 20, (size_t)32 << 20, (size_t)1 << 30})
+    {
+        int in = benchSource(size);
+        int out = memfd_create("bench.hack", MFD_CLOEXEC);
+        if (in < 0 || out < 0)
+        {
+            cout << "  cannot create the memfds" << endl;
+            passed = false;
+            break;
+        }
+        size_t words = size / 1024;
+        double limit = 0.1 + size * 20e-9;
+        string label = size < (1 << 20) ? to_string(size >> 10) + " KB" : size < (1 << 30) ? to_string(size >> 20) + " MB" : "1 GB";
+        auto expected = [&](string_view text)
+        {
+            if (text.size() != words * word.size())
+                return false;
+            for (size_t i = 0; i < text.size(); i += word.size())
+            {
+                if (text.substr(i, word.size()) != word)
+                    return false;
+            }
+            return true;
+        };
+        auto output = [&]()
+        {
+            string text(words * word.size() + 1, '\0');
+            ssize_t n = pread(out, &text[0], text.size(), 0);
+            text.resize(n > 0 ? n : 0);
+            return text;
+        };
+
+        if (size <= DAEMON_MAX_PAYLOAD)
+        {
+            string source(size, '\0');
+            bool read = pread(in, &source[0], size, 0) == (ssize_t)size;
+            AssemblyResult result;
+            auto start = chrono::steady_clock::now();
+            bool ok = read && benchSendSource(socketPath, source, result);
+            double seconds = secondsSince(start);
+            passed = benchRow(label + ", bytes", "through the socket", seconds, limit,
+                              ok && result.ok && expected(result.text)) && passed;
+        }
+        else
+            cout << "  " << label << ", bytes: refused, over the " << (DAEMON_MAX_PAYLOAD >> 20) << " MB request limit" << endl;
+
+        for (bool sealed : {false, true})
+        {
+            if (sealed && fcntl(in, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE) != 0)
+                break;
+            AssemblyResult result;
+            auto start = chrono::steady_clock::now();
+            bool ok = assembleRemote(socketPath, "/proc/self/fd/" + to_string(in), "/proc/self/fd/" + to_string(out), result);
+            double seconds = secondsSince(start);
+            passed = benchRow(label + ", descriptors", sealed ? "sealed memfd, mapped" : "plain fd, pread", seconds, limit,
+                              ok && result.ok && expected(output())) && passed;
+        }
+        close(in);
+        close(out);
+    }
+    kill(child, SIGKILL);
+    waitpid(child, nullptr, 0);
+    unlink(socketPath.c_str());
+    return passed;
+}
+#endif
+
+// links a 192k-instruction program split into 1, 10 and 100 objects on 1
+// to 8 threads, from opening the objects to writing the .hack, against
+// assembling the whole source; every linked output must match the
+// assembled one
+static bool benchLink()
+{
+    const int functions = 2000;
+    vector<string> bodies(functions);
+    for (int i = 0; i < functions; i++)
+    {
+        string &body = bodies[i];
+        body = "(F." + to_string(i) + ")\n";
+        for (int j = 0; j < 24; j++)
+        {
+            body += "@v." + to_string((i + j) % 64) + "\nD=M\n";
+            body += "@F." + to_string((i * 31 + j * 7) % functions) + "\nD;JGT\n";
+        }
+    }
+    string whole;
+    for (const string &body : bodies)
+        whole += body;
+
+    vector<uint16_t> rom;
+    string diagnostics;
+    auto start = chrono::steady_clock::now();
+    bool ok = assemble(whole, "link.asm", Options(), rom, diagnostics);
+    string expected = hackText(rom);
+    ok = writeFile(benchFile("link.hack", ""), expected) && ok;
+    double seconds = secondsSince(start);
+    double limit = 0.1 + rom.size() * 1e-6;
+    bool passed = benchRow("1 source", "assembled", seconds, limit, ok);
+
+    for (int count : {1, 10, 100})
+    {
+        vector<string> objects;
+        ok = true;
+        for (int m = 0; m < count; m++)
+        {
+            string source;
+            for (int i = m * functions / count; i < (m + 1) * functions / count; i++)
+                source += bodies[i];
+            ObjectModule module;
+            objects.push_back(benchFile("link." + to_string(m) + ".hobj", ""));
+            ok = assembleObject(source, "link.asm", module, diagnostics) && writeObject(objects.back(), module) && ok;
+        }
+        for (size_t threads : {1, 2, 4, 8})
+        {
+            ThreadPool pool(threads);
+            start = chrono::steady_clock::now();
+            vector<MappedObject *> modules;
+            bool linked = ok;
+            for (const string &object : objects)
+            {
+                modules.push_back(new MappedObject());
+                linked = modules.back()->open(object, diagnostics) && linked;
+            }
+            linked = linked && link(modules, pool, rom, diagnostics);
+            for (MappedObject *module : modules)
+                delete module;
+            string text = hackText(rom);
+            linked = writeFile(benchFile("link.hack", ""), text) && linked;
+            seconds = secondsSince(start);
+            passed = benchRow(to_string(count) + (count == 1 ? " object, " : " objects, ") + to_string(threads) +
+                                  (threads == 1 ? " thread" : " threads"),
+                              "linked", seconds, limit, linked && text == expected) && passed;
+        }
+        for (const string &object : objects)
+            filesystem::remove(object);
+    }
+    filesystem::remove(benchFile("link.hack", ""));
+    return passed;
+}
+
+// runs two loops on the interpreter and the jit for about 3*10^8
+// instructions each: one that stays in D, one that sums an array through a
+// pointer; the limit allows 20 ns per instruction, well below what
+// threaded dispatch reaches
+static bool benchEmulator()
+{
+    struct Program
+    {
+        const char *what;
+        const char *source;
+        uint16_t r1, r2;
+        bool array; // RAM[1024..] holds 0, 1, 2, ... and R0 ends as r2 times their sum
+    };
+    static const Program programs[] = {
+        {"register loop",
+         "(OUTER)\n@R2\nD=M\n@END\nD;JEQ\n@R2\nM=M-1\n@R1\nD=M\n"
+         "(INNER)\nD=D-1\n@INNER\nD;JGT\n@R0\nM=M+1\n@OUTER\n0;JMP\n"
+         "(END)\n@END\n0;JMP\n",
+         30000, 3000, false},
+        {"memory loop",
+         "(OUTER)\n@R2\nD=M\n@END\nD;JEQ\n@R2\nM=M-1\n@1024\nD=A\n@p\nM=D\n@R1\nD=M\n@i\nM=D\n"
+         "(INNER)\n@i\nD=M\n@OUTER\nD;JEQ\n@i\nM=M-1\n@p\nAM=M+1\nA=A-1\nD=M\n@R0\nM=D+M\n@INNER\n0;JMP\n"
+         "(END)\n@END\n0;JMP\n",
+         4096, 5000, true},
+    };
+    bool passed = true;
+    for (const Program &program : programs)
+    {
+        for (bool jit : {false, true})
+        {
+#ifndef HAVE_X86_64_JIT
+            if (jit)
+                break;
+#endif
+            vector<uint16_t> rom;
+            string diagnostics;
+            bool ok = assemble(program.source, "bench.asm", Options(), rom, diagnostics);
+            Emulator emulator;
+            emulator.load(rom);
+            emulator.ram[1] = program.r1;
+            emulator.ram[2] = program.r2;
+            uint16_t expected = program.r2;
+            if (program.array)
+            {
+                for (int i = 0; i < program.r1; i++)
+                    emulator.ram[1024 + i] = (uint16_t)i;
+                expected = (uint16_t)((uint64_t)program.r2 * (program.r1 * (program.r1 - 1) / 2));
+            }
+            auto start = chrono::steady_clock::now();
+            uint64_t executed;
+#ifdef HAVE_X86_64_JIT
+            if (jit)
+            {
+                Jit translator(emulator);
+                ok = translator.available() && ok;
+                executed = translator.run(UINT64_MAX);
+            }
+            else
+#endif
+                executed = emulator.run(UINT64_MAX);
+            double seconds = secondsSince(start);
+            char measure[64];
+            snprintf(measure, sizeof(measure), "%5.0f M instr %6.0f MIPS", executed / 1e6, executed / max(seconds, 1e-9) / 1e6);
+            passed = benchRow(string(program.what) + (jit ? ", jit" : ", interpreter"), measure, seconds,
+                              0.1 + executed * 20e-9, ok && emulator.halted && emulator.ram[0] == expected) && passed;
+        }
+    }
+    return passed;
+}
+
+struct Benchmark
+{
+    const char *name;
+    const char *description;
+    bool (*run)();
+};
+
+static const Benchmark benchmarks[] = {
+    {"strip", "whitespace and comment stripping on adversarial lines", benchStrip},
+    {"scan", "line splitting throughput against the getline loop", benchScan},
+    {"freeze", "perfect hash construction and lookups against unordered_map", benchFreeze},
+    {"constants", "numeric A instructions with and without the symbol table", benchConstants},
+    {"batch", "symbol resolution per prefetch batch size", benchBatch},
+    {"link", "linking 1, 10 and 100 objects on 1 to 8 threads against assembling the source", benchLink},
+    {"emulator", "interpreter and jit speed on a register loop and a memory loop", benchEmulator},
+#if defined(HAVE_UNIX_SOCKETS) && defined(__linux__)
+    {"daemon", "daemon latency for 1 KB to 1 GB, bytes against descriptors", benchDaemon},
+#endif
+};
+
+// runs the benchmarks named (all of them if none are) and returns the exit status
+int runBenchmarks(int argc, char *argv[])
+{
+    for (int i = 0; i < argc; i++)
+    {
+        if (find_if(begin(benchmarks), end(benchmarks), [&](const Benchmark &b)
+                    { return argv[i] == string(b.name); }) == end(benchmarks))
+        {
+            cerr << "unknown benchmark: " << argv[i] << endl;
+            return 2;
+        }
+    }
+    bool passed = true;
+    for (const Benchmark &benchmark : benchmarks)
+    {
+        if (argc > 0 && find(argv, argv + argc, string(benchmark.name)) == argv + argc)
+            continue;
+        cout << benchmark.name << ": " << benchmark.description << endl;
+        passed = benchmark.run() && passed;
+    }
+    return passed ? 0 : 1;
 }
\ No newline at end of file